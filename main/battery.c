@@ -4,55 +4,152 @@
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_err.h"
+#include "nvs_flash.h"
 
 #include "driver/adc.h"
 
 #include "battery.h"
+#include "scheduler.h"
 
 static const char* TAG = "m-link-battery";
 
-static volatile uint16_t battery_level = -1;
+// Samples per burst, the middle half are averaged so spikes in either direction are thrown away
+#define BATTERY_BURST 8
 
-static void battery_task(void* pvParam)
-{
-  ESP_LOGI(TAG, "Started battery task.");
+// Filter weight of each new burst, as a shift, and fractional bits kept by the filter
+#define BATTERY_FILTER_SHIFT 2
+#define BATTERY_FILTER_FRAC  4
+
+// Default calibration, 3.3/1 potential divider so a full scale reading of 1 V on TOUT is 4.3 V
+#define BATTERY_DEFAULT_SCALE_MV 4300
+
+/*
+ * Published reading, double-buffered so telemetry consumers can read it without locking
+ *
+ * battery_poll is the only writer. It fills the back buffer and bumps the generation, whose low bit selects the
+ * front buffer, and readers retry if the generation changed while they were copying.
+ */
+static battery_reading_t battery_readings[2];
+static volatile uint32_t battery_generation = 0;
+
+static battery_calibration_t battery_calibration = { .scale_mv = BATTERY_DEFAULT_SCALE_MV, .offset_mv = 0 };
+static volatile bool battery_calibration_dirty = false;
+static SemaphoreHandle_t battery_commit_lock = NULL;
+static volatile bool battery_sag_reset = true;
 
-  // Update battery reading once per second
-  const TickType_t interval = pdMS_TO_TICKS(1000);
-  TickType_t previous_wake_time = xTaskGetTickCount();
+// Read a burst of samples back to back and return the mean of the middle half, or -1 if the ADC failed
+static int battery_sample_burst(void)
+{
+  uint16_t samples[BATTERY_BURST];
+  for (int index = 0; index < BATTERY_BURST; ++index)
+  {
+    if (adc_read(&samples[index]) != ESP_OK)
+    {
+      return -1;
+    }
+  }
 
-  uint16_t data;
-  for (;;)
+  // Insertion sort, it's only a handful of samples
+  for (int index = 1; index < BATTERY_BURST; ++index)
   {
-    // Read battery level from the ADC
-    esp_err_t ret = adc_read(&data);
-    if (ret == ESP_OK)
+    const uint16_t sample = samples[index];
+    int position = index;
+    for (; position > 0 && samples[position - 1] > sample; --position)
     {
-      // Convert into a voltage (using 10/1 potential divider resulting in divide by 11)
-      // Convert into a voltage (using 3.3/1 potential divider resulting in divide by 4.3)
-      data = (uint32_t)(((float)data * 4.3f * 1023.f) / 1000.f);
- 
-      // Write battery level
-      battery_level = data;
-
-      ESP_LOGD(TAG, "Read battery level: %d", battery_level);
+      samples[position] = samples[position - 1];
     }
-    else
+    samples[position] = sample;
+  }
+
+  uint32_t sum = 0;
+  for (int index = BATTERY_BURST / 4; index < BATTERY_BURST - BATTERY_BURST / 4; ++index)
+  {
+    sum += samples[index];
+  }
+  return (sum + BATTERY_BURST / 4) / (BATTERY_BURST / 2);
+}
+
+// Convert a raw ADC reading, optionally with fractional bits, into millivolts
+static int battery_to_mv(uint32_t raw, int frac)
+{
+  const int mv = (int)((raw * battery_calibration.scale_mv) >> (10 + frac)) + battery_calibration.offset_mv;
+  return mv < 0 ? 0 : (mv > UINT16_MAX ? UINT16_MAX : mv);
+}
+
+static void battery_publish(const battery_reading_t* reading)
+{
+  const uint32_t generation = battery_generation;
+  battery_readings[(generation + 1) & 1] = *reading;
+
+  // The reading must be complete before it becomes the front buffer
+  __sync_synchronize();
+  battery_generation = generation + 1;
+}
+
+static void battery_poll(void)
+{
+  static battery_reading_t reading = {};
+  static uint32_t filtered = 0;
+  static bool primed = false;
+
+  // The scheduler runs this just after a tick, so the burst lands before most of the work that tick wakes up
+  const int raw = battery_sample_burst();
+  if (raw >= 0)
+  {
+    // Integer IIR filter, started from the first burst rather than ramping up from zero
+    const uint32_t sample = (uint32_t)raw << BATTERY_FILTER_FRAC;
+    filtered = primed ? filtered + (((int32_t)sample - (int32_t)filtered) >> BATTERY_FILTER_SHIFT) : sample;
+    primed = true;
+
+    reading.raw = raw;
+    reading.mv = battery_to_mv(filtered, BATTERY_FILTER_FRAC);
+
+    // Track sag from each burst rather than the filtered value, so brief dips under load still show
+    const uint16_t burst_mv = battery_to_mv(raw, 0);
+    if (battery_sag_reset)
     {
-      ESP_ERROR_CHECK(ret);
+      battery_sag_reset = false;
+      reading.min_mv = reading.max_mv = burst_mv;
     }
+    reading.min_mv = burst_mv < reading.min_mv ? burst_mv : reading.min_mv;
+    reading.max_mv = burst_mv > reading.max_mv ? burst_mv : reading.max_mv;
+
+    battery_publish(&reading);
 
-    // Wait for the next interval
-    vTaskDelayUntil(&previous_wake_time, interval);
+    ESP_LOGD(TAG, "Read battery level: %d mV (raw %d)", reading.mv, raw);
+  }
+  else
+  {
+    ESP_LOGW(TAG, "Failed to read battery level.");
+  }
+}
+
+static void battery_load_calibration(void)
+{
+  battery_calibration_t calibration;
+  size_t length = sizeof(calibration);
+  nvs_handle_t nvs_handle;
+  ESP_ERROR_CHECK( nvs_open("nvs", NVS_READWRITE, &nvs_handle) );
+  esp_err_t err = nvs_get_blob(nvs_handle, "bat_cal", &calibration, &length);
+  nvs_close(nvs_handle);
+
+  if (err == ESP_OK && length == sizeof(calibration) && calibration.scale_mv > 0)
+  {
+    battery_calibration = calibration;
+    ESP_LOGI(TAG, "Battery calibration %d mV full scale, %d mV offset.", calibration.scale_mv, calibration.offset_mv);
   }
 }
 
 esp_err_t battery_init(void)
 {
+  battery_commit_lock = xSemaphoreCreateMutex();
+  battery_load_calibration();
+
   esp_err_t ret;
   adc_config_t config;
   config.mode = ADC_READ_TOUT_MODE;
@@ -61,7 +158,8 @@ esp_err_t battery_init(void)
 
   if (ret == ESP_OK)
   {
-    xTaskCreate(battery_task, "battery-task", 1024, NULL, 5, NULL);
+    // Update battery reading ten times per second, as often as telemetry can be pushed
+    scheduler_add("battery", battery_poll, 100);
   }
 
   return ret;
@@ -69,6 +167,89 @@ esp_err_t battery_init(void)
 
 uint16_t battery_get_level(void)
 {
-  return battery_level;
+  battery_reading_t reading;
+  battery_get_reading(&reading);
+  return reading.mv;
+}
+
+void battery_get_reading(battery_reading_t* reading)
+{
+  uint32_t generation;
+  do
+  {
+    generation = battery_generation;
+    __sync_synchronize();
+    *reading = battery_readings[generation & 1];
+    __sync_synchronize();
+  }
+  while (generation != battery_generation);
+}
+
+void battery_reset_sag(void)
+{
+  battery_sag_reset = true;
 }
 
+bool battery_calibrate(int mv)
+{
+  battery_reading_t reading;
+  battery_get_reading(&reading);
+  if (reading.raw == 0 || mv <= 0)
+  {
+    return false;
+  }
+
+  // Work out the full scale voltage from the latest burst, with no offset
+  const uint32_t scale_mv = ((uint32_t)mv << 10) / reading.raw;
+  if (scale_mv == 0 || scale_mv > UINT16_MAX)
+  {
+    return false;
+  }
+
+  // battery_poll converts with the calibration on every burst, so swap it while no task can be part way through one
+  const battery_calibration_t calibration = { .scale_mv = scale_mv, .offset_mv = 0 };
+  vTaskSuspendAll();
+  battery_calibration = calibration;
+  battery_calibration_dirty = true;
+  xTaskResumeAll();
+  battery_reset_sag();
+
+  ESP_LOGI(TAG, "Battery calibrated to %d mV full scale.", calibration.scale_mv);
+  return true;
+}
+
+esp_err_t battery_commit(void)
+{
+  // Held for the whole commit, so a commit before a reboot waits for one in progress rather than finding it clean
+  xSemaphoreTake(battery_commit_lock, portMAX_DELAY);
+  esp_err_t err = ESP_OK;
+  if (battery_calibration_dirty)
+  {
+    // Clear the flag before taking the copy, so a calibration racing the copy marks it dirty again
+    battery_calibration_t calibration;
+    vTaskSuspendAll();
+    battery_calibration_dirty = false;
+    calibration = battery_calibration;
+    xTaskResumeAll();
+
+    nvs_handle_t nvs_handle;
+    err = nvs_open("nvs", NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK)
+    {
+      err = nvs_set_blob(nvs_handle, "bat_cal", &calibration, sizeof(calibration));
+      if (err == ESP_OK)
+      {
+        err = nvs_commit(nvs_handle);
+      }
+      nvs_close(nvs_handle);
+    }
+
+    if (err != ESP_OK)
+    {
+      ESP_LOGW(TAG, "Failed to save battery calibration: %s", esp_err_to_name(err));
+      battery_calibration_dirty = true;
+    }
+  }
+  xSemaphoreGive(battery_commit_lock);
+  return err;
+}
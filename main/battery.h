@@ -1,6 +1,39 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// Latest battery measurement, the sag tracker covers every burst since it was last reset
+typedef struct
+{
+  uint16_t mv;        // Filtered voltage
+  uint16_t min_mv;    // Lowest and highest burst since the tracker was reset
+  uint16_t max_mv;
+  uint16_t raw;       // Latest burst straight from the ADC
+}
+battery_reading_t;
+
+// Per-board calibration, millivolts = raw * scale_mv / 1024 + offset_mv
+typedef struct
+{
+  uint16_t scale_mv;
+  int16_t offset_mv;
+}
+battery_calibration_t;
+
 esp_err_t battery_init(void);
 
+// Filtered battery voltage in millivolts
 uint16_t battery_get_level(void);
 
+// Copy the latest measurement, without locking
+void battery_get_reading(battery_reading_t* reading);
+
+// Start the sag tracker again from the next burst
+void battery_reset_sag(void);
+
+// Calibrate against a voltage measured now, returns false if there is no usable reading
+bool battery_calibrate(int mv);
+
+// Save the calibration to NVS if it has changed, it stays marked as changed if saving fails
+esp_err_t battery_commit(void);
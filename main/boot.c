@@ -0,0 +1,70 @@
+#include <string.h>
+
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "boot.h"
+
+/* Only app_main adds stages, each is written before the count includes it so readers never see a half written one */
+static boot_stage_t boot_stages[BOOT_MAX_STAGES];
+static volatile int boot_stage_count = 0;
+static volatile uint32_t boot_first_frame_us = 0;
+
+void boot_mark(const char* name)
+{
+  const int count = boot_stage_count;
+  if (count < BOOT_MAX_STAGES)
+  {
+    boot_stages[count].name = name;
+    boot_stages[count].end_us = esp_timer_get_time();
+    __sync_synchronize();
+    boot_stage_count = count + 1;
+  }
+}
+
+void boot_first_frame(void)
+{
+  if (!boot_first_frame_us)
+  {
+    boot_first_frame_us = esp_timer_get_time();
+  }
+}
+
+int boot_get_stages(boot_stage_t stages[BOOT_MAX_STAGES])
+{
+  const int count = boot_stage_count;
+  __sync_synchronize();
+  memcpy(stages, boot_stages, count * sizeof(boot_stage_t));
+  return count;
+}
+
+uint32_t boot_get_first_frame_us(void)
+{
+  return boot_first_frame_us;
+}
+
+const char* boot_reset_reason(void)
+{
+  switch (esp_reset_reason())
+  {
+    case ESP_RST_POWERON:
+      return "power_on";
+    case ESP_RST_EXT:
+      return "external";
+    case ESP_RST_SW:
+    case ESP_RST_FAST_SW:
+      return "software";
+    case ESP_RST_PANIC:
+      return "panic";
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+      return "watchdog";
+    case ESP_RST_DEEPSLEEP:
+      return "deep_sleep";
+    case ESP_RST_BROWNOUT:
+      return "brownout";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Boot timeline
+ *
+ * app_main marks the end of each startup stage, timed with esp_timer from when the timer started before app_main, so
+ * the first stage covers the SDK starting up. The first frame reaching the outputs is recorded separately
+ * as the time to first control.
+ */
+#define BOOT_MAX_STAGES 16
+
+typedef struct
+{
+  const char* name;
+  uint32_t end_us;
+}
+boot_stage_t;
+
+// Record the end of a stage, the name must be a string literal
+void boot_mark(const char* name);
+
+// Record the outputs being enabled by the first frame, only the first call counts
+void boot_first_frame(void);
+
+// Copy the stages recorded so far, returns how many there are
+int boot_get_stages(boot_stage_t stages[BOOT_MAX_STAGES]);
+
+// Time from startup to the first frame reaching the outputs, 0 if there hasn't been one yet
+uint32_t boot_get_first_frame_us(void);
+
+const char* boot_reset_reason(void);
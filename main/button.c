@@ -17,6 +17,7 @@
 #include "settings.h"
 
 #include "button.h"
+#include "scheduler.h"
 
 #define BUTTON_IO_COUNT   1
 
@@ -82,25 +83,13 @@ static void button_process(button_config_t* button_config)
   }
 }
 
-static void button_task(void* pvParam)
+static void button_poll(void)
 {
-  ESP_LOGI(TAG, "Started button task.");
-
-  // Update buttons every 100 ms
-  const TickType_t interval = pdMS_TO_TICKS(BUTTON_INTERVAL);
-  TickType_t previous_wake_time = xTaskGetTickCount();
-
-  for (;;)
+  // Process each button
+  for (int button_idx = 0; button_idx < BUTTON_IO_COUNT; ++button_idx)
   {
-    // Process each button
-    for (int button_idx = 0; button_idx < BUTTON_IO_COUNT; ++button_idx)
-    {
-      button_config_t* button_config = &button_configs[button_idx];
-      button_process(button_config);
-    }
-
-    // Wait for the next interval
-    vTaskDelayUntil(&previous_wake_time, interval);
+    button_config_t* button_config = &button_configs[button_idx];
+    button_process(button_config);
   }
 }
 
@@ -119,6 +108,6 @@ void button_init(void)
     ESP_ERROR_CHECK( gpio_config(&config) );
   }
 
-  // Start the button handler task
-  xTaskCreate(button_task, "button-task", 1024, NULL, 6, NULL);
+  // Poll the buttons every 100 ms
+  scheduler_add("button", button_poll, BUTTON_INTERVAL);
 }
@@ -1,13 +1,19 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 // Query the number of supported channels
 int query_supported_channels(void);
 
-// Update the desired pulsewidth for a servo
-void process_servo_event(int channel, int pulsewidth_ms);
+// Update the desired pulsewidth for each servo in the mask together, values are indexed by channel
+void process_servo_frame(uint16_t mask, const int* values);
+
+// Update the mixer axes in the mask, values are indexed by axis, and drive every mixed channel from the result
+void process_axes_frame(uint16_t mask, const int* values);
 
-// Update the desired failsafe pulsewidth for a servo
-void process_failsafe_event(int channel, int pulsewidth_ms);
+// Update the desired failsafe pulsewidth for each servo in the mask together, values are indexed by channel
+void process_failsafe_frame(uint16_t mask, const int* values);
 
 // Query the desired failsafe
 int query_failsafe(int channel);
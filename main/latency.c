@@ -0,0 +1,93 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "latency.h"
+
+#ifdef CONFIG_MLINK_LATENCY_STATS
+
+#ifndef CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ
+#define CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ 80
+#endif
+
+static const char* const stage_names[LATENCY_STAGES] = {
+  "decode",
+  "apply",
+  "output",
+  "total",
+};
+
+/* Updated from the httpd, UDP and rx tasks, always under a critical section */
+static latency_histogram_t histograms[LATENCY_STAGES];
+
+/* The last applied frame, waiting for rx_task to write it to the hardware */
+static bool pending = false;
+static uint32_t pending_received;
+static uint32_t pending_applied;
+
+static void latency_add(latency_stage_t stage, uint32_t cycles)
+{
+  const uint32_t us = cycles / CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ;
+  int bucket = 0;
+  if (us >= 8)
+  {
+    bucket = 31 - __builtin_clz(us) - 2;
+    if (bucket >= LATENCY_BUCKETS)
+    {
+      bucket = LATENCY_BUCKETS - 1;
+    }
+  }
+
+  latency_histogram_t* histogram = &histograms[stage];
+  ++histogram->count;
+  ++histogram->buckets[bucket];
+  if (us > histogram->max_us)
+  {
+    histogram->max_us = us;
+  }
+}
+
+void latency_frame_applied(uint32_t received, uint32_t decoded)
+{
+  const uint32_t now = latency_now();
+  portENTER_CRITICAL();
+  latency_add(LATENCY_DECODE, decoded - received);
+  latency_add(LATENCY_APPLY, now - decoded);
+  // A frame that is overwritten before rx_task runs never reaches the hardware, so only the newest is timed
+  pending = true;
+  pending_received = received;
+  pending_applied = now;
+  portEXIT_CRITICAL();
+}
+
+void latency_frame_output(void)
+{
+  const uint32_t now = latency_now();
+  portENTER_CRITICAL();
+  if (pending)
+  {
+    latency_add(LATENCY_OUTPUT, now - pending_applied);
+    latency_add(LATENCY_TOTAL, now - pending_received);
+    pending = false;
+  }
+  portEXIT_CRITICAL();
+}
+
+void latency_get_stats(latency_histogram_t stats[LATENCY_STAGES], bool reset)
+{
+  portENTER_CRITICAL();
+  memcpy(stats, histograms, sizeof(histograms));
+  if (reset)
+  {
+    memset(histograms, 0, sizeof(histograms));
+    pending = false;
+  }
+  portEXIT_CRITICAL();
+}
+
+const char* latency_stage_name(latency_stage_t stage)
+{
+  return stage_names[stage];
+}
+
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef CONFIG_MLINK_LATENCY_STATS
+#include "driver/soc.h"
+#endif
+
+/*
+ * Control latency histograms, timed with the CPU cycle counter
+ *
+ * decode   Frame received to frame decoded
+ * apply    Frame decoded to values handed to rx_task
+ * output   Values handed to rx_task to servo_refresh rebuilding the PWM edge tables, including rx_task waking up
+ * total    Frame received to servo_refresh rebuilding the PWM edge tables
+ *
+ * The timer interrupt only picks up a new table at its group's next period boundary, so the new pulses start up to
+ * one period after that, which is not counted here.
+ *
+ * Bucket 0 counts latencies under 8 us, bucket N counts 2^(N+2) us up to 2^(N+3) us, and the last bucket
+ * counts everything longer.
+ */
+#define LATENCY_BUCKETS 14
+
+typedef enum
+{
+  LATENCY_DECODE,
+  LATENCY_APPLY,
+  LATENCY_OUTPUT,
+  LATENCY_TOTAL,
+  LATENCY_STAGES,
+}
+latency_stage_t;
+
+typedef struct
+{
+  uint32_t count;
+  uint32_t max_us;
+  uint32_t buckets[LATENCY_BUCKETS];
+}
+latency_histogram_t;
+
+#ifdef CONFIG_MLINK_LATENCY_STATS
+
+// Timestamp for latency_frame_applied
+static inline uint32_t latency_now(void)
+{
+  return soc_get_ccount();
+}
+
+// Record a frame that was received and decoded at the given timestamps and has just been applied
+void latency_frame_applied(uint32_t received, uint32_t decoded);
+
+// Record the most recently applied frame reaching servo_refresh
+void latency_frame_output(void);
+
+// Copy the histograms for every stage, and optionally clear them
+void latency_get_stats(latency_histogram_t stats[LATENCY_STAGES], bool reset);
+
+const char* latency_stage_name(latency_stage_t stage);
+
+#else
+
+static inline uint32_t latency_now(void)
+{
+  return 0;
+}
+
+static inline void latency_frame_applied(uint32_t received, uint32_t decoded)
+{
+}
+
+static inline void latency_frame_output(void)
+{
+}
+
+#endif
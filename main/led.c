@@ -3,7 +3,7 @@
 #include <stdlib.h>
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/timers.h"
+#include "freertos/task.h"
 
 #include "esp_log.h"
 #include "esp_system.h"
@@ -11,42 +11,56 @@
 
 #include "driver/gpio.h"
 
-static const char* TAG = "m-link-rx-led";
+#include "led.h"
+#include "scheduler.h"
 
-typedef struct
-{
-  xTimerHandle timer;
-  gpio_num_t gpio_num;
-  int period;
-  int duty;
-  int state;
-}
-led_config_t;
+static const char* TAG = "m-link-rx-led";
 
 static led_config_t* config = NULL;
 static size_t led_num = 0;
 
-void led_timer_callback(xTimerHandle xTimer)
+// Step one LED through its pattern by one tick, returns the level it should show
+static int led_advance(led_config_t* info)
 {
-  led_config_t* info = (led_config_t*)pvTimerGetTimerID(xTimer);
+  const led_pattern_t* pattern = info->pattern;
+  if (!pattern || pattern->count == 0)
+  {
+    return 0;
+  }
 
-  if (info)
+  // Move on to the next step with a non-zero duration, a pattern of all zeros leaves the LED off
+  for (int tries = 0; info->remaining == 0 && tries < pattern->count; ++tries)
   {
-    // Currently on
-    if (info->state)
-    {
-      xTimerChangePeriod(info->timer, info->duty, 0);
-      info->state = 0;
-    }
-    // Currently off
-    else
+    info->step = (info->step + 1) % pattern->count;
+    info->remaining = pattern->steps[info->step];
+  }
+  if (info->remaining == 0)
+  {
+    return 0;
+  }
+
+  --info->remaining;
+
+  // Even steps are on and odd steps are off
+  return (info->step & 1) == 0;
+}
+
+static void led_poll(void)
+{
+  for (int led_idx = 0; led_idx < led_num; ++led_idx)
+  {
+    led_config_t* info = &config[led_idx];
+
+    portENTER_CRITICAL();
+    const int level = led_advance(info);
+    portEXIT_CRITICAL();
+
+    // Update LED, only touching the GPIO when it changes
+    if (level != info->level)
     {
-      xTimerChangePeriod(info->timer, info->period - info->duty, 0);
-      info->state = 1;
+      info->level = level;
+      ESP_ERROR_CHECK( gpio_set_level(info->gpio_num, level) );
     }
-
-    // Update LED
-    ESP_ERROR_CHECK( gpio_set_level(info->gpio_num, info->state) );
   }
 }
 
@@ -72,78 +86,33 @@ esp_err_t led_init(led_config_t* in_config, size_t in_led_num)
     config.pull_down_en = GPIO_PULLDOWN_DISABLE;
     config.intr_type = GPIO_INTR_DISABLE;
     ESP_ERROR_CHECK( gpio_config(&config) );
-    ESP_ERROR_CHECK( gpio_set_level(info->gpio_num, info->state) );
-
-    info->timer = xTimerCreate("rx-led-timer", info->duty, pdTRUE, (void*)info, &led_timer_callback);
-    if (!info->timer)
-    {
-      ESP_LOGW(TAG, "Failed to create LED timer.");
-      return ESP_FAIL;
-    }
-    if (xTimerStart(info->timer, 0) != pdPASS)
-    {
-      ESP_LOGW(TAG, "Failed to start LED timer.");
-      return ESP_FAIL;
-    }
+    ESP_ERROR_CHECK( gpio_set_level(info->gpio_num, 0) );
+    info->level = 0;
+    led_set_pattern(led_idx, info->pattern);
 
     ESP_LOGI(TAG, "Initialised LED on pin %d.", info->gpio_num);
   }
 
+  if (!scheduler_add("led", led_poll, LED_TICK_MS))
+  {
+    ESP_LOGW(TAG, "Failed to schedule LED updates.");
+    return ESP_FAIL;
+  }
+
   return ESP_OK;
 }
 
-void led_set(int index, int state, int duty, int period)
+void led_set_pattern(int index, const led_pattern_t* pattern)
 {
   if (index < led_num)
   {
     led_config_t* info = &config[index];
-    if (info->timer)
-    {
-      info->duty = pdMS_TO_TICKS(duty);
-      info->period = pdMS_TO_TICKS(period);
-      info->state = state;
-      // Always off - avoid using a timer
-      if (duty <= 0)
-      {
-        if (xTimerStop(info->timer, 0) != pdPASS)
-        {
-          ESP_LOGW(TAG, "Timer stop failed.");
-        }
-        ESP_ERROR_CHECK( gpio_set_level(info->gpio_num, 0) );
-      }
-      // Always on - avoid using a timer
-      else if (duty >= period)
-      {
-        if (xTimerStop(info->timer, 0) != pdPASS)
-        {
-          ESP_LOGW(TAG, "Timer stop failed.");
-        }
-        ESP_ERROR_CHECK( gpio_set_level(info->gpio_num, 1) );
-      }
-      // Blinking - using a timer
-      else
-      {
-        if (info->state)
-        {
-          if (xTimerChangePeriod(info->timer, info->duty, 0) != pdPASS)
-          {
-            ESP_LOGW(TAG, "Timer change period failed.");
-          }
-        }
-        else
-        {
-          if (xTimerChangePeriod(info->timer, info->period - info->duty, 0) != pdPASS)
-          {
-            ESP_LOGW(TAG, "Timer change period failed.");
-          }
-        }
-        if (xTimerReset(info->timer, 0) != pdPASS)
-        {
-          ESP_LOGW(TAG, "Timer restart failed.");
-        }
-        ESP_ERROR_CHECK( gpio_set_level(info->gpio_num, info->state) );
-      }
-    }
+
+    // Start from the first step on the next tick
+    portENTER_CRITICAL();
+    info->pattern = pattern;
+    info->step = pattern && pattern->count ? pattern->count - 1 : 0;
+    info->remaining = 0;
+    portEXIT_CRITICAL();
   }
 }
-
@@ -1,20 +1,37 @@
 #pragma once
 
+#include <stdint.h>
+
 #include "driver/gpio.h"
 
+// LEDs are stepped through their patterns on this tick
+#define LED_TICK_MS 100
+
+/*
+ * A blink pattern, as a sequence of durations in LED ticks
+ *
+ * Even steps are on and odd steps are off, and the pattern repeats from the start. A zero duration skips the step,
+ * so { 0, 10 } is always off, and a single step such as { 10 } is always on.
+ */
+typedef struct
+{
+  const uint8_t* steps;
+  uint8_t count;
+}
+led_pattern_t;
+
 typedef struct
 {
-  xTimerHandle timer;
   gpio_num_t gpio_num;
-  int period;
-  int duty;
-  int state;
+  const led_pattern_t* pattern;
+  uint8_t step;       // Step being shown
+  uint8_t remaining;  // Ticks left in it
+  int level;          // What the LED is currently showing
 }
 led_config_t;
 
-// Initialise LED driver
+// Initialise LED driver, LEDs are stepped by the scheduler
 esp_err_t led_init(led_config_t* config, size_t led_num);
 
-// Set LED duty and period
-void led_set(int index, int state, int duty, int period);
-
+// Switch an LED to a new pattern, starting from its first step
+void led_set_pattern(int index, const led_pattern_t* pattern);
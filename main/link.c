@@ -0,0 +1,154 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_timer.h"
+#include "esp_wifi.h"
+
+#include "link.h"
+#include "scheduler.h"
+
+#define LINK_SAMPLE_MS  1000
+
+/* Updated from the httpd, UDP, rx and scheduler tasks, always under a critical section */
+static uint16_t link_gaps[LINK_GAP_BUCKETS];
+static int64_t link_last_frame_us = 0;
+static uint32_t link_frames = 0;
+static uint32_t link_max_gap_ms = 0;
+static uint16_t link_failsafes = 0;
+
+/* Written by link_sample once a second */
+static uint32_t link_sampled_frames = 0;
+static uint16_t link_rate = 0;
+static int8_t link_ap_rssi = 0;
+static uint8_t link_station_count = 0;
+static link_station_t link_stations[LINK_MAX_STATIONS];
+
+static void link_sample(void)
+{
+  // Ask the WiFi driver first, outside the critical section, it fails harmlessly until WiFi has started
+  wifi_sta_list_t list;
+  if (esp_wifi_ap_get_sta_list(&list) != ESP_OK)
+  {
+    list.num = 0;
+  }
+  wifi_ap_record_t ap;
+  const int8_t ap_rssi = esp_wifi_sta_get_ap_info(&ap) == ESP_OK ? ap.rssi : 0;
+
+  portENTER_CRITICAL();
+  link_rate = link_frames - link_sampled_frames;
+  link_sampled_frames = link_frames;
+  link_ap_rssi = ap_rssi;
+  link_station_count = list.num < LINK_MAX_STATIONS ? list.num : LINK_MAX_STATIONS;
+  for (int index = 0; index < link_station_count; ++index)
+  {
+    memcpy(link_stations[index].mac, list.sta[index].mac, sizeof(link_stations[index].mac));
+    link_stations[index].rssi = list.sta[index].rssi;
+  }
+  portEXIT_CRITICAL();
+}
+
+void link_init(void)
+{
+  scheduler_add("link", link_sample, LINK_SAMPLE_MS);
+}
+
+void link_frame_received(void)
+{
+  const int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL();
+  // The first frame of a session has nothing to measure from
+  if (link_last_frame_us)
+  {
+    const int64_t gap_ms = (now - link_last_frame_us) / 1000;
+    const int bucket = gap_ms < LINK_GAP_BUCKETS ? (int)gap_ms : LINK_GAP_BUCKETS - 1;
+
+    // Halve every bucket rather than let one saturate, which keeps the shape of the histogram
+    if (link_gaps[bucket] == UINT16_MAX)
+    {
+      for (int index = 0; index < LINK_GAP_BUCKETS; ++index)
+      {
+        link_gaps[index] >>= 1;
+      }
+    }
+    ++link_gaps[bucket];
+
+    if (gap_ms > link_max_gap_ms)
+    {
+      link_max_gap_ms = gap_ms > UINT32_MAX ? UINT32_MAX : (uint32_t)gap_ms;
+    }
+  }
+  link_last_frame_us = now;
+  ++link_frames;
+  portEXIT_CRITICAL();
+}
+
+void link_failsafe_engaged(void)
+{
+  portENTER_CRITICAL();
+  ++link_failsafes;
+  portEXIT_CRITICAL();
+}
+
+// Call under the critical section
+static void link_clear(void)
+{
+  memset(link_gaps, 0, sizeof(link_gaps));
+  link_last_frame_us = 0;
+  link_frames = 0;
+  link_sampled_frames = 0;
+  link_max_gap_ms = 0;
+  link_failsafes = 0;
+}
+
+void link_reset(void)
+{
+  portENTER_CRITICAL();
+  link_clear();
+  portEXIT_CRITICAL();
+}
+
+// Smallest gap that at least the given share of gaps, in percent, are no longer than
+static uint16_t link_percentile(const uint16_t* gaps, uint32_t total, uint32_t percent)
+{
+  const uint32_t threshold = (total * percent + 99) / 100;
+  uint32_t count = 0;
+  for (int bucket = 0; bucket < LINK_GAP_BUCKETS; ++bucket)
+  {
+    count += gaps[bucket];
+    if (count >= threshold)
+    {
+      return bucket;
+    }
+  }
+  return LINK_GAP_BUCKETS - 1;
+}
+
+void link_get_stats(link_stats_t* stats, bool reset)
+{
+  uint16_t gaps[LINK_GAP_BUCKETS];
+
+  portENTER_CRITICAL();
+  memcpy(gaps, link_gaps, sizeof(gaps));
+  stats->frames = link_frames;
+  stats->rate = link_rate;
+  stats->max_gap_ms = link_max_gap_ms;
+  stats->failsafes = link_failsafes;
+  stats->ap_rssi = link_ap_rssi;
+  stats->station_count = link_station_count;
+  memcpy(stats->stations, link_stations, sizeof(stats->stations));
+  if (reset)
+  {
+    link_clear();
+  }
+  portEXIT_CRITICAL();
+
+  // Work out the percentiles from the copy, outside the critical section
+  uint32_t total = 0;
+  for (int bucket = 0; bucket < LINK_GAP_BUCKETS; ++bucket)
+  {
+    total += gaps[bucket];
+  }
+  stats->p50_ms = total ? link_percentile(gaps, total, 50) : 0;
+  stats->p99_ms = total ? link_percentile(gaps, total, 99) : 0;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Link quality statistics
+ *
+ * Frame inter-arrival gaps go into a histogram with 1 ms buckets, the last bucket counting every gap at least that
+ * long. Along with the failsafe count they cover the current session, which starts when a driver takes control or
+ * the statistics are reset. The frame rate and the signal strength of each connected station are sampled once a
+ * second, so RF trouble (weak signal, long gaps) can be told apart from the app sending slowly (good signal, low
+ * rate).
+ */
+#define LINK_GAP_BUCKETS    256
+#define LINK_MAX_STATIONS   4
+
+typedef struct
+{
+  uint8_t mac[6];
+  int8_t rssi;
+}
+link_station_t;
+
+typedef struct
+{
+  uint32_t frames;        // Frames this session
+  uint16_t rate;          // Frames over the last second
+  uint16_t p50_ms;        // Median and 99th percentile gap between frames
+  uint16_t p99_ms;
+  uint32_t max_gap_ms;    // Longest gap between frames
+  uint16_t failsafes;     // Times failsafe engaged
+  int8_t ap_rssi;         // Signal from the upstream access point, 0 when not connected to one
+  uint8_t station_count;
+  link_station_t stations[LINK_MAX_STATIONS];
+}
+link_stats_t;
+
+// Start sampling the signal strength
+void link_init(void);
+
+// Record a frame arriving, from whichever task published it
+void link_frame_received(void);
+
+// Record failsafe engaging
+void link_failsafe_engaged(void);
+
+// Start a new session
+void link_reset(void);
+
+// Copy the statistics for the current session, and optionally start a new one
+void link_get_stats(link_stats_t* stats, bool reset);
@@ -6,9 +6,16 @@ class MLink {
     this.onmessage = undefined
     this.onopen = undefined
     this.onclose = undefined
+    this.ontelemetry = undefined
     this._status = 'waiting'
     this._channels = 6
-    this._awaiting = []
+    this._pending = new Map()
+    this._nextId = 0
+    this._features = []
+    this._streaming = false
+    this._seq = 0
+    this._appliedSeq = undefined
+    this._telemetry = {}
 
     if (options.onmessage) {
       this.onmessage = options.onmessage
@@ -19,6 +26,9 @@ class MLink {
     if (options.onclose) {
       this.onclose = options.onclose
     }
+    if (options.ontelemetry) {
+      this.ontelemetry = options.ontelemetry
+    }
     if (options.failsafes) {
       this._failsafes = options.failsafes
     }
@@ -39,12 +49,27 @@ class MLink {
       if (obj.status) {
         localthis._status = obj.status
       }
+      if (obj.seq) {
+        localthis._appliedSeq = parseInt(obj.seq)
+      }
 
-      // If we queued up a function handle this response then call it
-      const resolve = localthis._awaiting.shift()
-      if (resolve)
-      {
-        resolve(obj)
+      // Pushed events are not responses, so leave any waiting requests alone
+      if (!obj.event) {
+        // Match the response to its request by ID, or to the oldest request if the device didn't echo one
+        const key = (obj.id !== undefined) ? String(obj.id) : localthis._pending.keys().next().value
+        const pending = localthis._pending.get(key)
+        if (pending) {
+          localthis._pending.delete(key)
+          clearTimeout(pending.timer)
+          pending.resolve(obj)
+        }
+      }
+
+      if (obj.event === 'telemetry') {
+        localthis._telemetry = obj
+        if (localthis.ontelemetry) {
+          localthis.ontelemetry(obj)
+        }
       }
 
       if (localthis.onmessage) {
@@ -72,15 +97,19 @@ class MLink {
     // Send initial settings query
     const settings = await this.getSettings()
 
-    if (this._failsafes) {
-      await this.setFailsafes(this._failsafes)
-    } else {
+    let failsafes = this._failsafes
+    if (!failsafes) {
       // Once we know (or guess) the number of channels, set sensible failsafes
       if (settings && settings.channels) {
         this._channels = parseInt(settings.channels)
       }
-      const failsafes = new Array(this.channels)
+      failsafes = new Array(this.channels)
       failsafes.fill(1500)
+    }
+
+    // The device keeps its failsafes across power cycles, so only send them if they are different
+    const saved = (settings && settings.failsafes) ? settings.failsafes.map(pw => parseInt(pw)) : []
+    if (failsafes.some((pw, channel) => pw !== saved[channel])) {
       await this.setFailsafes(failsafes)
     }
   }
@@ -92,6 +121,20 @@ class MLink {
     return this._status
   }
 
+  /*
+   * Get the sequence number of the last servo frame the device applied
+   */
+  get appliedSeq() {
+    return this._appliedSeq
+  }
+
+  /*
+   * Get the most recent telemetry pushed by the device
+   */
+  get telemetry() {
+    return this._telemetry
+  }
+
   /*
    * Get the supported number of channels
    */
@@ -99,27 +142,55 @@ class MLink {
     return this._channels
   }
 
+  /*
+   * Check if the device advertised support for an optional protocol feature
+   */
+  supports (feature) {
+    return this._features.includes(feature)
+  }
+
   /*
    * Wrapper around WebSocket send
-   * Returns only once a response is received
+   * Tags the message with a request ID and returns only once the matching response is received
    */
   async _send (msg) {
+    const id = this._allocId()
+    return await this._sendRaw(JSON.stringify({ id: id, ...msg }), id)
+  }
+
+  /*
+   * Send a pre-encoded text or binary payload carrying request ID id
+   * Several requests can be in flight at once, each returns only once its response is received
+   */
+  async _sendRaw (data, id) {
     const localthis = this
+    const key = String(id)
     const promise = new Promise((resolve, reject) => {
-      // Send the message whose response will resolve this promise
-      localthis._ws.send(JSON.stringify(msg))
+      // Reject if there is no response after 300 ms, and forget the request so a late response is ignored
+      const timer = setTimeout(() => {
+        localthis._pending.delete(key)
+        reject({status: 'timed out'})
+      }, 300)
+
+      // onmessage will call resolve when the matching response comes in
+      localthis._pending.set(key, { resolve: resolve, timer: timer })
 
-      // onmessage will call resolve when the relevant response comes in
-      localthis._awaiting.push(resolve)
- 
-      // Reject if there is no response after 300 ms
-      setTimeout(() => reject({status: 'timed out'}), 300)
+      // Send the message whose response will resolve this promise
+      localthis._ws.send(data)
     })
 
     // Wait for the promise to be resolved or rejected
     return await promise
   }
 
+  /*
+   * Request ID for the next acknowledged message, wrapping at 32 bits
+   */
+  _allocId () {
+    this._nextId = (this._nextId + 1) >>> 0
+    return this._nextId
+  }
+
   /*
    * Set the failsafes for each channel
    */
@@ -135,13 +206,278 @@ class MLink {
    * Set the pulsewidth for each servo
    */
   async setServos (servos) {
+    const seq = this._nextSeq()
+    if (this.supports('binary') && this.supports('id')) {
+      const id = this._allocId()
+      return await this._sendRaw(MLink.encodeServos(servos, seq, undefined, id), id)
+    }
     return await this._send(
       {
+        seq: seq,
         servos: servos
       }
     )
   }
 
+  /*
+   * Set the logical input axes (-1000 to 1000), which the device's mixer turns into pulsewidths for every channel
+   */
+  async setAxes (axes) {
+    const seq = this._nextSeq()
+    if (this.supports('binary') && this.supports('mixer')) {
+      const id = this._allocId()
+      return await this._sendRaw(MLink.encodeServos(axes, seq, undefined, id, true), id)
+    }
+    return await this._send(
+      {
+        seq: seq,
+        axes: axes
+      }
+    )
+  }
+
+  /*
+   * Sequence number for the next servo frame, wrapping at 32 bits
+   */
+  _nextSeq () {
+    this._seq = (this._seq + 1) >>> 0
+    return this._seq
+  }
+
+  /*
+   * Switch to streaming mode, where servo frames are not acknowledged
+   * The device pushes status when failsafe changes and every heartbeat milliseconds
+   */
+  async startStreaming (heartbeat = 1000) {
+    const result = await this._send(
+      {
+        stream: true,
+        heartbeat: heartbeat
+      }
+    )
+    this._streaming = (result && result.stream === 'on')
+    return result
+  }
+
+  /*
+   * Return to acknowledged servo frames
+   */
+  async stopStreaming () {
+    const result = await this._send(
+      {
+        stream: false
+      }
+    )
+    this._streaming = false
+    return result
+  }
+
+  /*
+   * Send servo pulsewidths without waiting for a response
+   * Requires streaming mode, returns false if the frame was dropped because the link is still busy
+   */
+  streamServos (servos) {
+    if (!this._streaming) {
+      this.setServos(servos).catch(() => {})
+      return true
+    }
+    // Drop rather than queue behind a frame that hasn't gone out yet, the next one will be newer
+    if (this._ws.readyState !== 1 || this._ws.bufferedAmount > 0) {
+      return false
+    }
+    const seq = this._nextSeq()
+    if (this.supports('binary')) {
+      this._ws.send(MLink.encodeServos(servos, seq))
+    } else {
+      this._ws.send(JSON.stringify({ seq: seq, servos: servos }))
+    }
+    return true
+  }
+
+  /*
+   * Set the pulsewidth for only some servos, given as an object mapping channel index to pulsewidth
+   * Channels that are not listed are left alone
+   */
+  async setChannels (channels) {
+    const packed = MLink.packChannels(channels)
+    const seq = this._nextSeq()
+    if (this.supports('binary') && this.supports('id')) {
+      const id = this._allocId()
+      return await this._sendRaw(MLink.encodeServos(packed.values, seq, packed.mask, id), id)
+    }
+    return await this._send(
+      {
+        seq: seq,
+        servo_mask: packed.mask,
+        servos: packed.values
+      }
+    )
+  }
+
+  /*
+   * Set the failsafe for only some channels, given as an object mapping channel index to pulsewidth
+   */
+  async setFailsafeChannels (channels) {
+    const packed = MLink.packChannels(channels)
+    return await this._send(
+      {
+        failsafe_mask: packed.mask,
+        failsafes: packed.values
+      }
+    )
+  }
+
+  /*
+   * Pack an object mapping channel index to value into a channel mask and values in channel order
+   */
+  static packChannels (channels) {
+    let mask = 0
+    const values = []
+    Object.keys(channels).map(channel => parseInt(channel)).sort((a, b) => a - b).forEach(channel => {
+      mask |= (1 << channel)
+      values.push(parseInt(channels[channel]))
+    })
+    return { mask: mask, values: values }
+  }
+
+  /*
+   * Encode servo pulsewidths as a binary frame
+   * Without a sequence number or mask: version 1, channel count, then little-endian uint16 pulsewidths
+   * Otherwise: version 2, flags, channel count or little-endian uint16 mask, little-endian uint32 sequence number,
+   * little-endian uint32 request ID, then pulsewidths, or signed mixer axes if axes is set
+   */
+  static encodeServos (servos, seq, mask, id, axes = false) {
+    if (seq === undefined && mask === undefined && id === undefined && !axes) {
+      const buffer = new ArrayBuffer(2 + 2 * servos.length)
+      const view = new DataView(buffer)
+      view.setUint8(0, 1)
+      view.setUint8(1, servos.length)
+      servos.forEach((pw, channel) => view.setUint16(2 + 2 * channel, parseInt(pw), true))
+      return buffer
+    }
+    const header = 2 + (mask === undefined ? 1 : 2) + (seq === undefined ? 0 : 4) + (id === undefined ? 0 : 4)
+    const buffer = new ArrayBuffer(header + 2 * servos.length)
+    const view = new DataView(buffer)
+    let offset = 0
+    view.setUint8(offset++, 2)
+    view.setUint8(offset++, (seq === undefined ? 0 : 0x01) | (mask === undefined ? 0 : 0x02) | (id === undefined ? 0 : 0x04) | (axes ? 0x08 : 0))
+    if (mask === undefined) {
+      view.setUint8(offset++, servos.length)
+    } else {
+      view.setUint16(offset, mask, true)
+      offset += 2
+    }
+    if (seq !== undefined) {
+      view.setUint32(offset, seq, true)
+      offset += 4
+    }
+    if (id !== undefined) {
+      view.setUint32(offset, id, true)
+      offset += 4
+    }
+    if (axes) {
+      servos.forEach((value, index) => view.setInt16(offset + 2 * index, parseInt(value), true))
+    } else {
+      servos.forEach((pw, index) => view.setUint16(offset + 2 * index, parseInt(pw), true))
+    }
+    return buffer
+  }
+
+  /*
+   * Claim the driver role ('driver') or give it up ('spectator')
+   * Only the driver's servos and failsafes are applied, the first connection to send servos becomes the driver
+   * and another connection can take over once the driver has let failsafe engage
+   */
+  async setRole (role) {
+    const result = await this._send(
+      {
+        role: role
+      }
+    )
+    if (result && result.role) {
+      return result.role
+    }
+    return 'spectator'
+  }
+
+  /*
+   * Ask the device to push telemetry for some topics ('battery', 'failsafe', 'link')
+   * Updates are pushed when a value changes and at least every rate milliseconds, pass no topics to unsubscribe
+   */
+  async subscribe (topics, rate = 1000) {
+    return await this._send(
+      {
+        subscribe: topics,
+        rate: rate
+      }
+    )
+  }
+
+  /*
+   * Update the device's mixer, any of mix (per channel array of axis percentages), trim, min, max, expo (per channel
+   * arrays) and reverse_mask can be given, anything left out keeps its current value
+   */
+  async setMixer (mixer) {
+    return await this._send(
+      {
+        mixer: mixer
+      }
+    )
+  }
+
+  /*
+   * Query the mixer configuration
+   */
+  async getMixer () {
+    const result = await this._send(
+      {
+        query : "mixer"
+      }
+    )
+    if (result && result.mixer) {
+      const channels = values => values.map(value => parseInt(value))
+      return {
+        mix: result.mixer.mix.map(channels),
+        trim: channels(result.mixer.trim),
+        min: channels(result.mixer.min),
+        max: channels(result.mixer.max),
+        expo: channels(result.mixer.expo),
+        reverse_mask: parseInt(result.mixer.reverse_mask)
+      }
+    }
+    return null
+  }
+
+  /*
+   * Smooth the outputs on the device, rate is a per channel array of the fastest change in microseconds per second
+   * (0 for no limit) and interpolate_mask selects channels that glide between frames instead of jumping
+   */
+  async setSlew (slew) {
+    return await this._send(
+      {
+        slew: slew
+      }
+    )
+  }
+
+  /*
+   * Query the output smoothing configuration
+   */
+  async getSlew () {
+    const result = await this._send(
+      {
+        query : "slew"
+      }
+    )
+    if (result && result.slew) {
+      return {
+        rate: result.slew.rate.map(value => parseInt(value)),
+        interpolate_mask: parseInt(result.slew.interpolate_mask)
+      }
+    }
+    return null
+  }
+
   /*
    * Update settings
    */
@@ -193,6 +529,84 @@ class MLink {
     return 0
   }
 
+  /*
+   * Query the lowest and highest battery voltage since the sag tracker was last reset, optionally resetting it
+   */
+  async getBatterySag (reset = false) {
+    const result = await this._send(
+      {
+        query : "battery",
+        reset: reset
+      }
+    )
+    if (result && result.battery_sag) {
+      return {
+        voltage: parseInt(result.battery),
+        min: parseInt(result.battery_sag.min),
+        max: parseInt(result.battery_sag.max),
+        raw: parseInt(result.battery_sag.raw)
+      }
+    }
+    return null
+  }
+
+  /*
+   * Query the link quality for this driving session, optionally starting a new one
+   */
+  async getLinkStats (reset = false) {
+    const result = await this._send(
+      {
+        query : "link",
+        reset: reset
+      }
+    )
+    if (result && result.link) {
+      const link = result.link
+      return {
+        frames: parseInt(link.frames),
+        rate: parseInt(link.rate),
+        p50: parseInt(link.p50_ms),
+        p99: parseInt(link.p99_ms),
+        maxGap: parseInt(link.max_gap_ms),
+        failsafes: parseInt(link.failsafes),
+        apRssi: link.ap_rssi !== undefined ? parseInt(link.ap_rssi) : null,
+        stations: link.stations.map(station => ({ mac: station.mac, rssi: parseInt(station.rssi) }))
+      }
+    }
+    return null
+  }
+
+  /*
+   * Query the boot timeline, with the reset reason and how long each startup stage took in microseconds
+   */
+  async getBootTimeline () {
+    const result = await this._send(
+      {
+        query : "boot"
+      }
+    )
+    if (result && result.boot) {
+      const boot = result.boot
+      return {
+        resetReason: boot.reset_reason,
+        stages: boot.stages.map(stage => ({ name: stage.name, us: parseInt(stage.us), endUs: parseInt(stage.end_us) })),
+        firstFrameUs: boot.first_frame_us !== undefined ? parseInt(boot.first_frame_us) : null
+      }
+    }
+    return null
+  }
+
+  /*
+   * Calibrate the battery reading against a voltage measured with a meter, in millivolts
+   */
+  async calibrateBattery (mv) {
+    return await this._send(
+      {
+        calibrate_battery: mv
+      }
+    )
+  }
+
   /*
    * Query Failsafes
    */
@@ -208,6 +622,41 @@ class MLink {
     return []
   }
 
+  /*
+   * Query sequence statistics for this connection
+   */
+  async getSequenceStats () {
+    const result = await this._send(
+      {
+        query : "sequence"
+      }
+    )
+    if (result && result.sequence) {
+      return {
+        last: parseInt(result.sequence.last),
+        drops: parseInt(result.sequence.drops),
+        gaps: parseInt(result.sequence.gaps)
+      }
+    }
+    return {}
+  }
+
+  /*
+   * Query control latency histograms, optionally clearing them
+   */
+  async getLatencyStats (reset = false) {
+    const result = await this._send(
+      {
+        query : "stats",
+        reset : reset
+      }
+    )
+    if (result && result.stats) {
+      return result.stats
+    }
+    return {}
+  }
+
   /*
    * Query Settings
    */
@@ -217,7 +666,11 @@ class MLink {
         query : "settings"
       }
     )
-    if (result && result.status && result.status === 'ok') {
+    // Features and settings are returned whatever the failsafe status, and the device is always in failsafe on connect
+    if (result && result.features) {
+      this._features = result.features
+    }
+    if (result && result.settings) {
       return result.settings
     }
     return {}
@@ -25,152 +25,247 @@
 #include <esp_vfs.h>
 
 #include "battery.h"
+#include "boot.h"
 #include "button.h"
 #include "dns.h"
 #include "event.h"
 #include "led.h"
+#include "link.h"
+#include "mixer.h"
+#include "scheduler.h"
 #include "server.h"
 #include "servo.h"
 #include "settings.h"
+#include "slew.h"
+#include "udp.h"
 #include "wifi.h"
 
 static const char *TAG = "m-link-lite-main";
 
 #define RX_LED_NUM  1
 
+/*
+ * Status LED patterns, chosen from the link health
+ *
+ * Durations are in LED ticks (100 ms), alternating on and off, in priority order from the top.
+ */
+typedef enum
+{
+  RX_LED_WAITING,       // Nobody has driven yet, slow even blink
+  RX_LED_FAILSAFE,      // Fast flicker
+  RX_LED_LOW_BATTERY,   // Double blip
+  RX_LED_LINK_POOR,     // Under RX_LINK_OK_RATE frames per second, blinking off as much as on
+  RX_LED_LINK_OK,       // Under RX_LINK_GOOD_RATE frames per second, on with a short gap
+  RX_LED_LINK_GOOD,     // Solid on
+  RX_LED_STATES,
+}
+rx_led_state_t;
+
+#define RX_LINK_GOOD_RATE 20
+#define RX_LINK_OK_RATE   5
+
+static const uint8_t rx_led_waiting[] = { 10, 10 };
+static const uint8_t rx_led_failsafe[] = { 1, 4 };
+static const uint8_t rx_led_low_battery[] = { 1, 1, 1, 7 };
+static const uint8_t rx_led_link_poor[] = { 3, 3 };
+static const uint8_t rx_led_link_ok[] = { 9, 1 };
+static const uint8_t rx_led_link_good[] = { 10 };
+
+static const led_pattern_t rx_led_patterns[RX_LED_STATES] = {
+  [RX_LED_WAITING] = { rx_led_waiting, sizeof(rx_led_waiting) },
+  [RX_LED_FAILSAFE] = { rx_led_failsafe, sizeof(rx_led_failsafe) },
+  [RX_LED_LOW_BATTERY] = { rx_led_low_battery, sizeof(rx_led_low_battery) },
+  [RX_LED_LINK_POOR] = { rx_led_link_poor, sizeof(rx_led_link_poor) },
+  [RX_LED_LINK_OK] = { rx_led_link_ok, sizeof(rx_led_link_ok) },
+  [RX_LED_LINK_GOOD] = { rx_led_link_good, sizeof(rx_led_link_good) },
+};
+
 static led_config_t rx_led_config[RX_LED_NUM] = {
   {
-    .timer = NULL,
     .gpio_num = GPIO_NUM_16,
-    .period = pdMS_TO_TICKS(2000),
-    .duty = pdMS_TO_TICKS(1000),
-    .state = 0,
+    .pattern = &rx_led_patterns[RX_LED_WAITING],
   },
 };
 
-typedef enum
+int query_battery_voltage(void)
 {
-  RX_LED_WAITING,
-  RX_LED_ACTIVE,
-  RX_LED_FAILSAFE,
-  RX_LED_INITIAL,
+  return battery_get_level();
 }
-rx_led_state_t;
 
-rx_led_state_t rx_led_state = RX_LED_INITIAL;
 
-void rx_led_set_state(rx_led_state_t new_state)
+bool failsafe_elapsed = false;
+
+#define SERVO_NUM   6
+
+// Failsafes are kept in the settings, which load them before rx_task enables the servos
+#if SERVO_NUM > SETTINGS_FAILSAFES
+#error "Settings must store a failsafe for every servo"
+#endif
+
+/*
+ * Double-buffered servo frame
+ *
+ * Writers fill the back buffer from the front one and publish it by bumping the generation, whose low bit selects
+ * the front buffer. rx_task never locks, it copies the front buffer and retries if a new frame was published
+ * meanwhile. The writer lock only keeps the httpd and UDP tasks from filling the back buffer at the same time.
+ */
+typedef struct
 {
-  if (new_state != rx_led_state)
-  {
-    switch (new_state)
-    {
-      case RX_LED_WAITING:
-      {
-        led_set(0, 1, 1000, 2000);
-      } break;
-      case RX_LED_ACTIVE:
-      {
-        led_set(0, 1, 1000, 1000);
-      } break;
-      case RX_LED_FAILSAFE:
-      {
-        led_set(0, 1, 100, 500);
-      } break;
-      default:
-      {
-        ESP_LOGW(TAG, "Invalid LED state requested.");
-      }
-    }
-    rx_led_state = new_state;
-  }
+  int values[SERVO_NUM];
 }
+servo_buffer_t;
 
-static int battery_level = 0;
+static servo_buffer_t servo_buffers[2] = {
+  { { 1500, 1500, 1500, 1500, 1500, 1500 } },
+  { { 1500, 1500, 1500, 1500, 1500, 1500 } },
+};
+static volatile uint32_t servo_generation = 0;
+static SemaphoreHandle_t servo_writer_lock = NULL;
 
-int query_battery_voltage(void)
+static void servo_frame_publish(uint16_t mask, const int* values)
 {
-  return battery_level;
+  xSemaphoreTake(servo_writer_lock, portMAX_DELAY);
+  const uint32_t generation = servo_generation;
+  const servo_buffer_t* front = &servo_buffers[generation & 1];
+  servo_buffer_t* back = &servo_buffers[(generation + 1) & 1];
+  for (int channel = 0; channel < SERVO_NUM; ++channel)
+  {
+    back->values[channel] = (mask & (1u << channel)) ? values[channel] : front->values[channel];
+  }
+
+  // The frame must be complete before it becomes the front buffer
+  __sync_synchronize();
+  servo_generation = generation + 1;
+  xSemaphoreGive(servo_writer_lock);
 }
 
-void rx_telemetry_task(void* args)
+// Returns the generation of the frame that was copied
+static uint32_t servo_frame_read(int* frame)
 {
-  ESP_LOGI(TAG, "Started telemetry task.");
+  uint32_t generation;
+  do
+  {
+    generation = servo_generation;
+    __sync_synchronize();
+    memcpy(frame, servo_buffers[generation & 1].values, sizeof(servo_buffers[0].values));
+    __sync_synchronize();
+  }
+  while (generation != servo_generation);
+  return generation;
+}
 
-  // Initialise battery voltage and RSSI measurement
-  ESP_ERROR_CHECK( battery_init() );
+int query_supported_channels(void)
+{
+  return SERVO_NUM;
+}
 
-  // Update telemetry once a second
-  const TickType_t interval = pdMS_TO_TICKS(1000);
-  TickType_t previous_wake_time = xTaskGetTickCount();
+/* Woken whenever a new servo frame is published */
+static TaskHandle_t rx_task_handle = NULL;
 
-  for (;;)
+static void rx_task_notify(void)
+{
+  if (rx_task_handle)
   {
-    // Print battery level
-    battery_level = battery_get_level();
-    //ESP_LOGI(TAG, "Battery Level: %d", battery_level);
-
-    // Wait for the next interval
-    vTaskDelayUntil(&previous_wake_time, interval);
+    xTaskNotifyGive(rx_task_handle);
   }
 }
 
-xTimerHandle rx_failsafe_timer = NULL;
-bool failsafe_elapsed = false;
+/*
+ * Staged failsafe
+ *
+ * Publishing a frame only stamps the time it arrived, rx_task works out the failsafe stage from the age of the last
+ * frame each time it wakes. Outputs hold their last values for the failsafe timeout, then ramp towards the failsafes
+ * over the ramp time, and then sit at the failsafes until the next frame.
+ */
+static volatile TickType_t rx_last_frame = 0;
 
-#define SERVO_NUM   6
-static int servos[SERVO_NUM] = { 1500, 1500, 1500, 1500, 1500, 1500 };
-static int failsafes[SERVO_NUM] = { 1500, 1500, 1500, 1500, 1500, 1500 };
+static void rx_frame_received(void)
+{
+  rx_last_frame = xTaskGetTickCount();
+  link_frame_received();
+  rx_task_notify();
+}
 
-int query_supported_channels(void)
+static int rx_clamp_pulsewidth(int pulsewidth)
 {
-  return SERVO_NUM;
+  return pulsewidth < SERVO_INPUT_MIN ? SERVO_INPUT_MIN : (pulsewidth > SERVO_INPUT_MAX ? SERVO_INPUT_MAX : pulsewidth);
 }
 
-void process_servo_event(int channel, int pulsewidth_ms)
+void process_servo_frame(uint16_t mask, const int* values)
 {
-  if (channel >= 0 && channel < SERVO_NUM)
+  if (mask >> SERVO_NUM)
   {
-    // Update the channel
-    servos[channel] = pulsewidth_ms;
-    
-    // Reset failsafe
-    xTimerReset(rx_failsafe_timer, 0);
-    if (failsafe_elapsed)
-    {
-      // Log the first time we reset
-      ESP_LOGW(TAG, "Failsafe disengaged.");
+    ESP_LOGW(TAG, "Ignoring request to set out of range servos 0x%x.", mask & ~((1u << SERVO_NUM) - 1));
+  }
 
-      // Set LED state to active
-      rx_led_set_state(RX_LED_ACTIVE);
-    }
-    failsafe_elapsed = false;
+  // A frame that sets no channels isn't a frame, it mustn't keep the link alive or leave failsafe
+  if (!(mask & ((1u << SERVO_NUM) - 1)))
+  {
+    return;
   }
-  else
+
+  // Clamp to the range the servo driver accepts before anything else sees the values, slew works in fixed point and
+  // must never be handed something that overflows it
+  int clamped[SERVO_NUM];
+  for (int channel = 0; channel < SERVO_NUM; ++channel)
   {
-    ESP_LOGW(TAG, "Ignoring request to set out of range servo %d to %d ms.", channel, pulsewidth_ms);
+    clamped[channel] = rx_clamp_pulsewidth(values[channel]);
   }
+
+  // Publish every channel in the frame together so rx_task never sees half a frame
+  servo_frame_publish(mask, clamped);
+
+  // Wake rx_task, which preempts the caller and leaves failsafe if it was engaged
+  rx_frame_received();
 }
 
-void process_failsafe_event(int channel, int pulsewidth_ms)
+void process_axes_frame(uint16_t mask, const int* values)
 {
-  if (channel >= 0 && channel < SERVO_NUM)
+  if (mask >> MIXER_AXES)
   {
-    // Update the failsafe
-    failsafes[channel] = pulsewidth_ms;
+    ESP_LOGW(TAG, "Ignoring request to set out of range axes 0x%x.", mask & ~((1u << MIXER_AXES) - 1));
   }
-  else
+
+  // Like servo frames, a frame that sets no axes mustn't keep the link alive or leave failsafe
+  if (!(mask & ((1u << MIXER_AXES) - 1)))
   {
-    ESP_LOGW(TAG, "Ignoring request to set out of range failsafe value %d to %d ms.", channel, pulsewidth_ms);
+    return;
   }
+
+  // The mixer keeps the latest axes, so serialise it against the other writers
+  int channels[MIXER_CHANNELS];
+  xSemaphoreTake(servo_writer_lock, portMAX_DELAY);
+  mixer_apply(mask, values, channels);
+  xSemaphoreGive(servo_writer_lock);
+
+  process_servo_frame((1u << MIXER_CHANNELS) - 1, channels);
+}
+
+void process_failsafe_frame(uint16_t mask, const int* values)
+{
+  if (mask >> SERVO_NUM)
+  {
+    ESP_LOGW(TAG, "Ignoring request to set out of range failsafe values 0x%x.", mask & ~((1u << SERVO_NUM) - 1));
+  }
+
+  // Update every failsafe in the frame together so rx_task never applies half a frame
+  portENTER_CRITICAL();
+  for (int channel = 0; channel < SERVO_NUM; ++channel)
+  {
+    if (mask & (1u << channel))
+    {
+      settings_set_failsafe(channel, rx_clamp_pulsewidth(values[channel]));
+    }
+  }
+  portEXIT_CRITICAL();
+  rx_task_notify();
 }
 
 int query_failsafe(int channel)
 {
   if (channel >= 0 && channel < SERVO_NUM)
   {
-    // Update the failsafe
-    return failsafes[channel];
+    return settings_get_failsafe(channel);
   }
   else
   {
@@ -184,69 +279,198 @@ bool query_failsafe_engaged(void)
     return failsafe_elapsed;
 }
 
-void rx_failsafe_callback(xTimerHandle xTimer)
+/*
+ * Pick the status LED pattern from the link health
+ *
+ * The frame rate is the number of frames published over the last second, read from the servo frame generation
+ * which counts every published frame.
+ */
+#define RX_LED_RATE_WINDOW (1000 / LED_TICK_MS)
+
+static void rx_led_update(void)
 {
-  // Print a message when failsafe elapses
-  if (!failsafe_elapsed)
-  {
-    ESP_LOGW(TAG, "Failsafe engaged - send an update to disengage!");
+  static uint32_t generations[RX_LED_RATE_WINDOW];
+  static int oldest = 0;
+  static rx_led_state_t state = RX_LED_WAITING;
+
+  const uint32_t generation = servo_generation;
+  const uint32_t rate = generation - generations[oldest];
+  generations[oldest] = generation;
+  oldest = (oldest + 1) % RX_LED_RATE_WINDOW;
 
-    // Set LED to indicate failsafe
-    rx_led_set_state(RX_LED_FAILSAFE);
+  rx_led_state_t new_state;
+  if (generation == 0)
+  {
+    new_state = RX_LED_WAITING;
+  }
+  else if (failsafe_elapsed)
+  {
+    new_state = RX_LED_FAILSAFE;
+  }
+#if CONFIG_MLINK_LOW_BATTERY_MV > 0
+  else if (battery_get_level() < CONFIG_MLINK_LOW_BATTERY_MV)
+  {
+    new_state = RX_LED_LOW_BATTERY;
+  }
+#endif
+  else if (rate < RX_LINK_OK_RATE)
+  {
+    new_state = RX_LED_LINK_POOR;
+  }
+  else if (rate < RX_LINK_GOOD_RATE)
+  {
+    new_state = RX_LED_LINK_OK;
+  }
+  else
+  {
+    new_state = RX_LED_LINK_GOOD;
   }
 
-  // Stop servo updates from rx_task
-  failsafe_elapsed = true;
+  // Only restart the pattern when it changes, so it plays through
+  if (new_state != state)
+  {
+    state = new_state;
+    led_set_pattern(0, &rx_led_patterns[state]);
+  }
+}
 
-  // Set failsafe values to the servos
-  for (int channel = 0; channel < SERVO_NUM; ++channel)
+// Save changed settings, mixer and slew configuration and battery calibration only while nobody is driving, a flash
+// erase stalls the CPU
+static void rx_settings_commit(void)
+{
+  if (servo_generation == 0 || failsafe_elapsed)
   {
-    // Negative failsafe values indicate that the channel should be held
-    // Positive values are the pulsewidth to set
-    if (failsafes[channel] >= 0)
-    {
-      servo_set(channel, failsafes[channel]);
-    }
+    settings_commit();
+    mixer_commit();
+    slew_commit();
+    battery_commit();
   }
-  servo_refresh();
 }
 
 void rx_task(void* args)
 {
   ESP_LOGI(TAG, "Started servo task");
 
-  // Wait 2 seconds on startup before enabling the servos
-  vTaskDelay(pdMS_TO_TICKS(2000));
+  // The servos stay disabled until the first frame has been written to them, so nothing moves until someone drives
+  bool enabled = false;
 
-  ESP_LOGI(TAG, "Enable servos");
-  servo_enable();
+  // Never sleep for no time at all, whatever the tick rate
+  const TickType_t step_ticks = pdMS_TO_TICKS(SLEW_STEP_MS) > 0 ? pdMS_TO_TICKS(SLEW_STEP_MS) : 1;
 
-  // Update servos every 20 ms
-  const TickType_t interval = pdMS_TO_TICKS(20);
-  TickType_t previous_wake_time = xTaskGetTickCount();
+  int outputs[SERVO_NUM];
+  int ramp_start[SERVO_NUM];
+  uint32_t applied_generation = 0;
+  slew_step(outputs);
 
+  // Frames that arrived while starting up are applied straight away
+  TickType_t wait = 0;
   for (;;)
   {
-    if (!failsafe_elapsed)
+    // Sleep until a frame or failsafe update arrives, the next failsafe stage is due, or the next smoothing step
+    ulTaskNotifyTake(pdTRUE, wait);
+
+    // Read the frame time first, so a frame arriving now can't look like it came from the future
+    const TickType_t last_frame = rx_last_frame;
+    const TickType_t age = xTaskGetTickCount() - last_frame;
+    const TickType_t timeout = pdMS_TO_TICKS(settings_get_failsafe_timeout());
+    const TickType_t ramp = pdMS_TO_TICKS(settings_get_failsafe_ramp());
+
+    if (age < timeout)
     {
-      // Update the servo driver if not in failsafe mode
+      if (failsafe_elapsed)
+      {
+        ESP_LOGW(TAG, "Failsafe disengaged.");
+        failsafe_elapsed = false;
+
+        // Let streaming clients know
+        server_notify_status();
+      }
+
+      // Take a consistent copy of the latest frame, without blocking on the network tasks
+      if (servo_generation != applied_generation)
+      {
+        int frame[SERVO_NUM];
+        applied_generation = servo_frame_read(frame);
+        if (!enabled)
+        {
+          // Start from the first frame rather than smoothing towards it from wherever failsafe left the outputs
+          for (int channel = 0; channel < SERVO_NUM; ++channel)
+          {
+            slew_reset(channel, frame[channel]);
+          }
+        }
+        slew_set_targets(frame);
+      }
+
+      // Smooth the outputs, and come back when the failsafe timeout would run out
+      const bool moving = slew_step(outputs);
+      wait = timeout - age;
+      wait = (moving && step_ticks < wait) ? step_ticks : wait;
+    }
+    else
+    {
+      if (!failsafe_elapsed)
+      {
+        ESP_LOGW(TAG, "Failsafe engaged - send an update to disengage!");
+        failsafe_elapsed = true;
+        memcpy(ramp_start, outputs, sizeof(ramp_start));
+        link_failsafe_engaged();
+
+        // Let streaming clients know
+        server_notify_status();
+      }
+
+      // Take a consistent copy of the failsafes
+      int frame[SERVO_NUM];
+      portENTER_CRITICAL();
       for (int channel = 0; channel < SERVO_NUM; ++channel)
       {
-        servo_set(channel, servos[channel]);
+        frame[channel] = settings_get_failsafe(channel);
       }
-      servo_refresh();
+      portEXIT_CRITICAL();
+
+      // Ramp from where the outputs were towards the failsafes, negative failsafes hold the channel
+      const TickType_t into = age - timeout;
+      const bool ramping = into < ramp;
+      for (int channel = 0; channel < SERVO_NUM; ++channel)
+      {
+        const int target = frame[channel] >= 0 ? frame[channel] : ramp_start[channel];
+        outputs[channel] = ramping ? ramp_start[channel] + (target - ramp_start[channel]) * (int)into / (int)ramp : target;
+
+        // Smoothing carries on from here when frames come back
+        slew_reset(channel, outputs[channel]);
+      }
+      wait = ramping ? step_ticks : portMAX_DELAY;
+    }
+
+    // Update the servo driver
+    for (int channel = 0; channel < SERVO_NUM; ++channel)
+    {
+      servo_set(channel, outputs[channel]);
     }
 
-    // Wait for the next interval
-    vTaskDelayUntil(&previous_wake_time, interval);
+    // Each channel's group picks its new pulse width up at that group's next period boundary, so no pulse is cut short
+    servo_refresh();
+
+    if (!enabled && applied_generation != 0)
+    {
+      ESP_LOGI(TAG, "Enable servos");
+      servo_enable();
+      enabled = true;
+      boot_first_frame();
+    }
   }
 }
 
 void app_main()
 {
+  // The SDK starting up, before app_main
+  boot_mark("startup");
+
   // Initialise and immediately disable servo module as soon as possible to avoid glitches
   servo_init();
   servo_disable();
+  boot_mark("servo");
 
   // Initialize NVS
   esp_err_t err = nvs_flash_init();
@@ -258,36 +482,73 @@ void app_main()
     err = nvs_flash_init();
   }
   ESP_ERROR_CHECK(err);
+  boot_mark("nvs");
 
   // Initialise settings
   settings_init();
+  boot_mark("settings");
+
+  // Save settings changes in the background
+  scheduler_add("settings", rx_settings_commit, 1000);
+
+  // Load the mixer and output smoothing configuration
+  mixer_init();
+  slew_init();
 
-  // Set LED to boot state (2 second flash)
+  // Switch the outputs to their configured modes
+  if (!servo_set_modes(settings_get_pwm_modes()))
+  {
+    ESP_LOGW(TAG, "Invalid PWM modes in settings, keeping defaults.");
+  }
+  boot_mark("config");
+
+  // Start the status LED, which blinks slowly until the first frame arrives
   ESP_ERROR_CHECK( led_init(rx_led_config, RX_LED_NUM) );
-  rx_led_set_state(RX_LED_WAITING);
+  scheduler_add("status-led", rx_led_update, LED_TICK_MS);
+  boot_mark("led");
 
   // Initialise button handler
   button_init();
 
+  // Initialise battery voltage measurement
+  ESP_ERROR_CHECK( battery_init() );
+  boot_mark("inputs");
+
+  // Push telemetry to WebSocket subscribers every 100 ms, the fastest they can ask for
+  scheduler_add("telemetry", server_notify_telemetry, 100);
+
+  // Sample the link rate and station signal strength once a second
+  link_init();
+
+  // Start the periodic jobs, so the LED blinks while everything else starts
+  scheduler_start();
+  boot_mark("scheduler");
+
   // Create event loop
   ESP_ERROR_CHECK(esp_event_loop_create_default());
 
-  // Initialise WiFi
+  // Start the access point, the station connects in the background so nothing below waits for it
   wifi_init_apsta();
+  boot_mark("wifi");
 
-  // Start the webserver
+  // Create the servo frame writer lock before anything can send servo values
+  servo_writer_lock = xSemaphoreCreateMutex();
+
+  // Start the webserver, which mounts SPIFFS and formats it if it has to
   server_init();
+  boot_mark("server");
 
-  // Initialise RX task
-  xTaskCreate(rx_task, "rx-task", 2048, NULL, 10, NULL);
+#ifdef CONFIG_MLINK_UDP_CONTROL
+  // Start the UDP control channel
+  udp_init();
+  boot_mark("udp");
+#endif
 
-  // Initialise RX telemetry task
-  xTaskCreate(rx_telemetry_task, "rx-telemetry-task", 2048, NULL, 7, NULL);
+  // Initialise RX task
+  xTaskCreate(rx_task, "rx-task", 2048, NULL, 10, &rx_task_handle);
+  boot_mark("rx_task");
 
   // Initialise mDNS
   mlink_dns_init();
-
-  // Start failsafe timer
-  rx_failsafe_timer = xTimerCreate("rx-failsafe-timer", pdMS_TO_TICKS(500), pdTRUE, NULL, rx_failsafe_callback);
-  xTimerStart(rx_failsafe_timer, 0);
+  boot_mark("dns");
 }
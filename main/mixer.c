@@ -0,0 +1,208 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+#include "mixer.h"
+
+static const char* TAG = "m-link-mixer";
+
+// Expo lookup table points, evenly spaced from 0 to MIXER_AXIS_MAX
+#define EXPO_STEP    25
+#define EXPO_POINTS  (MIXER_AXIS_MAX / EXPO_STEP + 1)
+
+static mixer_config_t mixer_config;
+static volatile bool mixer_dirty = false;
+static SemaphoreHandle_t mixer_commit_lock = NULL;
+static int16_t expo_lut[MIXER_CHANNELS][EXPO_POINTS];
+
+// Latest value of each axis, so a frame can update just some of them
+static int mixer_axes[MIXER_AXES];
+
+static void mixer_default_config(mixer_config_t* config)
+{
+  // Pass each axis straight through to the channel with the same number
+  memset(config, 0, sizeof(*config));
+  for (int channel = 0; channel < MIXER_CHANNELS; ++channel)
+  {
+    if (channel < MIXER_AXES)
+    {
+      config->mix[channel][channel] = 100;
+    }
+    config->min[channel] = 1000;
+    config->max[channel] = 2000;
+  }
+}
+
+// Precompute y = (1 - e) x + e x^3 for each channel, so applying expo is a lookup and a linear interpolation
+static void mixer_build_luts(const mixer_config_t* config, int16_t lut[MIXER_CHANNELS][EXPO_POINTS])
+{
+  for (int channel = 0; channel < MIXER_CHANNELS; ++channel)
+  {
+    const int32_t expo = config->expo[channel];
+    for (int point = 0; point < EXPO_POINTS; ++point)
+    {
+      const int32_t x = point * EXPO_STEP;
+      const int32_t x3 = x * x / MIXER_AXIS_MAX * x / MIXER_AXIS_MAX;
+      lut[channel][point] = ((100 - expo) * x + expo * x3) / 100;
+    }
+  }
+}
+
+static int mixer_expo(int channel, int value)
+{
+  const int magnitude = value < 0 ? -value : value;
+  const int point = magnitude / EXPO_STEP;
+  int shaped = expo_lut[channel][point];
+  if (point + 1 < EXPO_POINTS)
+  {
+    shaped += (expo_lut[channel][point + 1] - shaped) * (magnitude % EXPO_STEP) / EXPO_STEP;
+  }
+  return value < 0 ? -shaped : shaped;
+}
+
+void mixer_apply(uint16_t mask, const int* axes, int* channels)
+{
+  for (int axis = 0; axis < MIXER_AXES; ++axis)
+  {
+    if (mask & (1u << axis))
+    {
+      const int value = axes[axis];
+      mixer_axes[axis] = value < -MIXER_AXIS_MAX ? -MIXER_AXIS_MAX : (value > MIXER_AXIS_MAX ? MIXER_AXIS_MAX : value);
+    }
+  }
+
+  for (int channel = 0; channel < MIXER_CHANNELS; ++channel)
+  {
+    // Weighted sum of the axes, clamped to full scale
+    int value = 0;
+    for (int axis = 0; axis < MIXER_AXES; ++axis)
+    {
+      value += mixer_config.mix[channel][axis] * mixer_axes[axis];
+    }
+    value /= 100;
+    value = value < -MIXER_AXIS_MAX ? -MIXER_AXIS_MAX : (value > MIXER_AXIS_MAX ? MIXER_AXIS_MAX : value);
+
+    value = mixer_expo(channel, value);
+    if (mixer_config.reverse_mask & (1u << channel))
+    {
+      value = -value;
+    }
+
+    // Scale each half onto its endpoint from the trimmed centre
+    const int centre = 1500 + mixer_config.trim[channel];
+    const int endpoint = value < 0 ? mixer_config.min[channel] : mixer_config.max[channel];
+    channels[channel] = centre + (value < 0 ? -value : value) * (value < 0 ? centre - endpoint : endpoint - centre) / MIXER_AXIS_MAX;
+  }
+}
+
+void mixer_get_config(mixer_config_t* config)
+{
+  *config = mixer_config;
+}
+
+static bool mixer_config_valid(const mixer_config_t* config)
+{
+  for (int channel = 0; channel < MIXER_CHANNELS; ++channel)
+  {
+    const int centre = 1500 + config->trim[channel];
+    if (config->trim[channel] < -500 || config->trim[channel] > 500 || config->expo[channel] < 0 || config->expo[channel] > 100 ||
+        config->min[channel] > centre || config->max[channel] < centre || config->min[channel] < 500 || config->max[channel] > 2500)
+    {
+      return false;
+    }
+    for (int axis = 0; axis < MIXER_AXES; ++axis)
+    {
+      if (config->mix[channel][axis] < -100 || config->mix[channel][axis] > 100)
+      {
+        return false;
+      }
+    }
+  }
+  return (config->reverse_mask >> MIXER_CHANNELS) == 0;
+}
+
+bool mixer_set_config(const mixer_config_t* config)
+{
+  if (!mixer_config_valid(config))
+  {
+    return false;
+  }
+
+  // Build the tables first, then swap them in while no task can be part way through mixing
+  int16_t lut[MIXER_CHANNELS][EXPO_POINTS];
+  mixer_build_luts(config, lut);
+  vTaskSuspendAll();
+  mixer_config = *config;
+  memcpy(expo_lut, lut, sizeof(expo_lut));
+  mixer_dirty = true;
+  xTaskResumeAll();
+
+  return true;
+}
+
+esp_err_t mixer_commit(void)
+{
+  // Held for the whole commit, so a commit before a reboot waits for one in progress rather than finding it clean
+  xSemaphoreTake(mixer_commit_lock, portMAX_DELAY);
+  esp_err_t err = ESP_OK;
+  if (mixer_dirty)
+  {
+    // Clear the flag before taking the copy, so a change racing the copy marks it dirty again
+    mixer_config_t config;
+    vTaskSuspendAll();
+    mixer_dirty = false;
+    config = mixer_config;
+    xTaskResumeAll();
+
+    nvs_handle_t nvs_handle;
+    err = nvs_open("nvs", NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK)
+    {
+      err = nvs_set_blob(nvs_handle, "mixer", &config, sizeof(config));
+      if (err == ESP_OK)
+      {
+        err = nvs_commit(nvs_handle);
+      }
+      nvs_close(nvs_handle);
+    }
+
+    if (err != ESP_OK)
+    {
+      ESP_LOGW(TAG, "Failed to save mixer configuration: %s", esp_err_to_name(err));
+      mixer_dirty = true;
+    }
+  }
+  xSemaphoreGive(mixer_commit_lock);
+  return err;
+}
+
+void mixer_init(void)
+{
+  mixer_commit_lock = xSemaphoreCreateMutex();
+
+  mixer_config_t config;
+  size_t length = sizeof(config);
+  nvs_handle_t nvs_handle;
+  ESP_ERROR_CHECK( nvs_open("nvs", NVS_READWRITE, &nvs_handle) );
+  esp_err_t err = nvs_get_blob(nvs_handle, "mixer", &config, &length);
+  nvs_close(nvs_handle);
+
+  // Fall back to pass-through if there is no saved configuration or it is from a different layout
+  if (err != ESP_OK || length != sizeof(config) || !mixer_config_valid(&config))
+  {
+    if (err != ESP_ERR_NVS_NOT_FOUND)
+    {
+      ESP_LOGW(TAG, "Saved mixer configuration unusable, using defaults.");
+    }
+    mixer_default_config(&config);
+  }
+
+  mixer_config = config;
+  mixer_build_luts(&mixer_config, expo_lut);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * Mixer, turning logical input axes into channel pulse widths with integer maths only
+ *
+ * Axes run from -1000 to 1000. Each channel is the weighted sum of the axes, shaped by its expo curve, optionally
+ * reversed, and then scaled onto its endpoints around its trimmed centre.
+ */
+#define MIXER_AXES      4
+#define MIXER_CHANNELS  6
+
+#define MIXER_AXIS_MAX  1000
+
+typedef struct
+{
+  int16_t mix[MIXER_CHANNELS][MIXER_AXES];  // Percentage of each axis added to each channel
+  int16_t trim[MIXER_CHANNELS];             // Centre offset in us
+  int16_t min[MIXER_CHANNELS];              // Endpoints in us
+  int16_t max[MIXER_CHANNELS];
+  int16_t expo[MIXER_CHANNELS];             // Expo percentage, 0 is linear
+  uint16_t reverse_mask;                    // Bit set for each reversed channel
+}
+mixer_config_t;
+
+// Load the configuration from NVS, or the pass-through default if there is none
+void mixer_init(void);
+
+void mixer_get_config(mixer_config_t* config);
+
+// Validate and apply a new configuration, returns false without changing anything if it is invalid
+bool mixer_set_config(const mixer_config_t* config);
+
+// Save the configuration to NVS if it has changed, it stays marked as changed if saving fails
+esp_err_t mixer_commit(void);
+
+// Update the axes in the mask and work out every channel's pulse width, indexed by channel
+void mixer_apply(uint16_t mask, const int* axes, int* channels);
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+
+#include "event.h"
+#include "latency.h"
+#include "protocol.h"
+
+static const char* TAG = "m-link-protocol";
+
+// Read an unaligned little-endian 16 bit value
+static inline uint16_t get_le16(const uint8_t* p)
+{
+  return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+// Read an unaligned little-endian 32 bit value
+static inline uint32_t get_le32(const uint8_t* p)
+{
+  return (uint32_t)get_le16(p) | ((uint32_t)get_le16(p + 2) << 16);
+}
+
+bool protocol_decode_binary(const uint8_t* payload, size_t len, servo_frame_t* frame)
+{
+  // A frame rejected part way through must not leave a stale sequence number or request ID behind
+  frame->has_seq = false;
+  frame->has_id = false;
+
+  if (len < MLINK_BINARY_HEADER_LEN)
+  {
+    ESP_LOGW(TAG, "Binary frame too short (%d bytes).", len);
+    return false;
+  }
+
+  const uint8_t* p = payload;
+  const uint8_t* end = payload + len;
+  uint8_t flags = 0;
+  switch (*p++)
+  {
+    case MLINK_BINARY_VERSION:
+    {
+    } break;
+    case MLINK_BINARY_VERSION_EXT:
+    {
+      flags = *p++;
+    } break;
+    default:
+    {
+      ESP_LOGW(TAG, "Unsupported binary frame version %d.", payload[0]);
+      return false;
+    }
+  }
+
+  // Channel count or mask
+  const bool has_mask = (flags & MLINK_BINARY_FLAG_MASK) != 0;
+  if (end - p < (has_mask ? 2 : 1))
+  {
+    ESP_LOGW(TAG, "Binary frame too short (%d bytes).", len);
+    return false;
+  }
+  int count;
+  uint16_t mask;
+  if (has_mask)
+  {
+    mask = get_le16(p);
+    p += 2;
+    count = __builtin_popcount(mask);
+  }
+  else
+  {
+    count = *p++;
+    if (count > MLINK_BINARY_MAX_CHANNELS)
+    {
+      ESP_LOGW(TAG, "Binary frame channel count %d too large.", count);
+      return false;
+    }
+    mask = (uint16_t)((1u << count) - 1);
+  }
+
+  frame->has_seq = (flags & MLINK_BINARY_FLAG_SEQ) != 0;
+  if (frame->has_seq)
+  {
+    if (end - p < 4)
+    {
+      ESP_LOGW(TAG, "Binary frame too short for sequence number.");
+      return false;
+    }
+    frame->seq = get_le32(p);
+    p += 4;
+  }
+
+  frame->has_id = (flags & MLINK_BINARY_FLAG_ID) != 0;
+  if (frame->has_id)
+  {
+    if (end - p < 4)
+    {
+      ESP_LOGW(TAG, "Binary frame too short for request ID.");
+      return false;
+    }
+    frame->id = get_le32(p);
+    p += 4;
+  }
+
+  if (end - p != 2 * count)
+  {
+    ESP_LOGW(TAG, "Binary frame length %d does not match channel count %d.", len, count);
+    return false;
+  }
+
+  frame->axes = (flags & MLINK_BINARY_FLAG_AXES) != 0;
+  for (int index = 0; index < count; ++index)
+  {
+    const uint16_t value = get_le16(p + 2 * index);
+    frame->values[index] = frame->axes ? (int16_t)value : value;
+  }
+
+  return protocol_unpack_mask(frame, mask, count);
+}
+
+typedef struct
+{
+  const char* p;
+  const char* end;
+}
+json_cursor_t;
+
+static void json_skip_ws(json_cursor_t* c)
+{
+  while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\r' || *c->p == '\n'))
+  {
+    ++c->p;
+  }
+}
+
+// Consume an expected character, skipping leading whitespace
+static bool json_expect(json_cursor_t* c, char ch)
+{
+  json_skip_ws(c);
+  if (c->p < c->end && *c->p == ch)
+  {
+    ++c->p;
+    return true;
+  }
+  return false;
+}
+
+// Consume a quoted key and compare it, without consuming anything on a mismatch
+static bool json_key(json_cursor_t* c, const char* key)
+{
+  json_skip_ws(c);
+  const size_t key_len = strlen(key);
+  if (c->end - c->p < key_len + 2 || c->p[0] != '"' || memcmp(c->p + 1, key, key_len) != 0 || c->p[key_len + 1] != '"')
+  {
+    return false;
+  }
+  c->p += key_len + 2;
+  return json_expect(c, ':');
+}
+
+// Consume an unsigned integer of up to max_digits digits, anything with a fraction or exponent is left for cJSON
+static bool json_digits(json_cursor_t* c, int max_digits, uint32_t* value)
+{
+  const char* digits = c->p;
+  uint32_t result = 0;
+  while (c->p < c->end && *c->p >= '0' && *c->p <= '9' && c->p - digits < max_digits)
+  {
+    const uint32_t digit = *c->p++ - '0';
+    if (result > (UINT32_MAX - digit) / 10)
+    {
+      return false;
+    }
+    result = result * 10 + digit;
+  }
+  if (c->p == digits || (c->p < c->end && (*c->p == '.' || *c->p == 'e' || *c->p == 'E' || (*c->p >= '0' && *c->p <= '9'))))
+  {
+    return false;
+  }
+  *value = result;
+  return true;
+}
+
+// Consume a small signed integer
+static bool json_int(json_cursor_t* c, int* value)
+{
+  json_skip_ws(c);
+  bool negative = false;
+  if (c->p < c->end && *c->p == '-')
+  {
+    negative = true;
+    ++c->p;
+  }
+  uint32_t result;
+  if (!json_digits(c, 6, &result))
+  {
+    return false;
+  }
+  *value = negative ? -(int)result : (int)result;
+  return true;
+}
+
+// Consume a sequence number, which must fit in 32 bits
+static bool json_seq(json_cursor_t* c, uint32_t* value)
+{
+  json_skip_ws(c);
+  return json_digits(c, 10, value);
+}
+
+static bool json_servo_array(json_cursor_t* c, servo_frame_t* frame, int* count)
+{
+  if (!json_expect(c, '['))
+  {
+    return false;
+  }
+  *count = 0;
+  if (json_expect(c, ']'))
+  {
+    return true;
+  }
+  do
+  {
+    if (*count == MLINK_BINARY_MAX_CHANNELS || !json_int(c, &frame->values[(*count)++]))
+    {
+      return false;
+    }
+  }
+  while (json_expect(c, ','));
+
+  return json_expect(c, ']');
+}
+
+bool protocol_decode_servos_json(const char* payload, size_t len, servo_frame_t* frame)
+{
+  json_cursor_t c = { .p = payload, .end = payload + len };
+  bool has_servos = false;
+  bool has_mask = false;
+  int count = 0;
+  uint32_t mask = 0;
+
+  frame->has_seq = false;
+  frame->has_id = false;
+  frame->axes = false;
+  if (!json_expect(&c, '{'))
+  {
+    return false;
+  }
+
+  // Only "servos" or "axes", "servo_mask", "seq" and numeric "id" are understood, any other key needs the full parser
+  do
+  {
+    if (!has_servos && json_key(&c, "servos"))
+    {
+      if (!json_servo_array(&c, frame, &count))
+      {
+        return false;
+      }
+      has_servos = true;
+    }
+    else if (!has_servos && json_key(&c, "axes"))
+    {
+      if (!json_servo_array(&c, frame, &count))
+      {
+        return false;
+      }
+      has_servos = true;
+      frame->axes = true;
+    }
+    else if (!has_mask && json_key(&c, "servo_mask"))
+    {
+      json_skip_ws(&c);
+      if (!json_digits(&c, 5, &mask) || mask > UINT16_MAX)
+      {
+        return false;
+      }
+      has_mask = true;
+    }
+    else if (!frame->has_seq && json_key(&c, "seq"))
+    {
+      if (!json_seq(&c, &frame->seq))
+      {
+        return false;
+      }
+      frame->has_seq = true;
+    }
+    else if (!frame->has_id && json_key(&c, "id"))
+    {
+      if (!json_seq(&c, &frame->id))
+      {
+        return false;
+      }
+      frame->has_id = true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  while (json_expect(&c, ','));
+
+  if (!has_servos || !json_expect(&c, '}'))
+  {
+    return false;
+  }
+  json_skip_ws(&c);
+  if (c.p != c.end && *c.p != '\0')
+  {
+    return false;
+  }
+
+  return protocol_unpack_mask(frame, has_mask ? mask : (uint16_t)((1u << count) - 1), count);
+}
+
+bool protocol_sequence_accept(sequence_state_t* state, const servo_frame_t* frame)
+{
+  if (!frame->has_seq)
+  {
+    return true;
+  }
+
+  if (state->valid)
+  {
+    // Serial number arithmetic so the comparison survives wrapping
+    const int32_t delta = (int32_t)(frame->seq - state->last);
+    if (delta <= 0)
+    {
+      ++state->drops;
+      return false;
+    }
+    state->gaps += delta - 1;
+  }
+
+  state->valid = true;
+  state->last = frame->seq;
+  return true;
+}
+
+bool protocol_unpack_mask(servo_frame_t* frame, uint16_t mask, int count)
+{
+  if (__builtin_popcount(mask) != count)
+  {
+    return false;
+  }
+
+  // Work backwards so each value moves to a channel at or above its packed index
+  int index = count;
+  for (int channel = MLINK_BINARY_MAX_CHANNELS - 1; channel >= 0 && index > 0; --channel)
+  {
+    if (mask & (1u << channel))
+    {
+      frame->values[channel] = frame->values[--index];
+    }
+  }
+  frame->mask = mask;
+
+  return true;
+}
+
+void protocol_apply(const servo_frame_t* frame)
+{
+  if (frame->axes)
+  {
+    process_axes_frame(frame->mask, frame->values);
+  }
+  else
+  {
+    process_servo_frame(frame->mask, frame->values);
+  }
+  latency_frame_applied(frame->received, frame->decoded);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary servo frame, sent as a WebSocket binary frame
+ *
+ * Version 1
+ * Byte 0     Frame version (1)
+ * Byte 1     Channel count (N)
+ * Byte 2..   N little-endian uint16 pulse widths, one per channel starting at channel 0
+ *
+ * Version 2
+ * Byte 0     Frame version (2)
+ * Byte 1     Flags (MLINK_BINARY_FLAG_*)
+ * Byte 2     Channel count (N), or if MLINK_BINARY_FLAG_MASK is set
+ * Byte 2..3  Little-endian uint16 channel mask, N is the number of bits set
+ * Then       Little-endian uint32 sequence number, only if MLINK_BINARY_FLAG_SEQ is set
+ * Then       Little-endian uint32 request ID, echoed in the response, only if MLINK_BINARY_FLAG_ID is set
+ * Then       N little-endian uint16 pulse widths, for channels 0..N-1 or for each channel in the mask, or if
+ *            MLINK_BINARY_FLAG_AXES is set, N little-endian int16 mixer axes (-1000..1000) in the same layout
+ */
+#define MLINK_BINARY_VERSION      1
+#define MLINK_BINARY_VERSION_EXT  2
+#define MLINK_BINARY_HEADER_LEN   2
+#define MLINK_BINARY_MAX_CHANNELS 16
+#define MLINK_BINARY_MAX_LEN      (MLINK_BINARY_HEADER_LEN + 10 + 2 * MLINK_BINARY_MAX_CHANNELS)
+
+#define MLINK_BINARY_FLAG_SEQ     0x01
+#define MLINK_BINARY_FLAG_MASK    0x02
+#define MLINK_BINARY_FLAG_ID      0x04
+#define MLINK_BINARY_FLAG_AXES    0x08
+
+// A decoded servo frame, values are indexed by channel and only valid for channels in the mask
+typedef struct
+{
+  bool has_seq;
+  uint32_t seq;
+  bool has_id;
+  uint32_t id;
+  /* Cycle counter timestamps for latency stats, filled in by the transport */
+  uint32_t received;
+  uint32_t decoded;
+  /* Values are mixer axes rather than pulse widths */
+  bool axes;
+  uint16_t mask;
+  int values[MLINK_BINARY_MAX_CHANNELS];
+}
+servo_frame_t;
+
+// Sequence tracking for one source of servo frames
+typedef struct
+{
+  bool valid;
+  uint32_t last;
+  uint32_t drops;
+  uint32_t gaps;
+}
+sequence_state_t;
+
+// Decode a binary servo frame, returns false if the frame is malformed
+bool protocol_decode_binary(const uint8_t* payload, size_t len, servo_frame_t* frame);
+
+// Fast path for the common {"servos":[...]} or {"axes":[...]} message with optional "seq", "servo_mask" and "id" keys, returns false if the
+// payload has any other shape so it can be handed to the full JSON parser instead
+bool protocol_decode_servos_json(const char* payload, size_t len, servo_frame_t* frame);
+
+// Check a frame's sequence number against the last one applied, returns false if the frame is stale
+bool protocol_sequence_accept(sequence_state_t* state, const servo_frame_t* frame);
+
+// Apply a decoded frame to the servo outputs, through the mixer if it carries axes
+void protocol_apply(const servo_frame_t* frame);
+
+// Spread values packed in channel order out to the channels set in the mask, returns false if the
+// number of values doesn't match the mask
+bool protocol_unpack_mask(servo_frame_t* frame, uint16_t mask, int count);
@@ -0,0 +1,93 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+#include "scheduler.h"
+
+static const char* TAG = "m-link-scheduler";
+
+typedef struct
+{
+  const char* name;
+  scheduler_job_fn_t fn;
+  TickType_t period;
+  TickType_t next_run;
+}
+scheduler_job_t;
+
+static scheduler_job_t scheduler_jobs[SCHEDULER_MAX_JOBS];
+static int scheduler_job_count = 0;
+
+// Tick comparison that survives the tick count wrapping
+static inline bool scheduler_due(TickType_t now, TickType_t time)
+{
+  return (int32_t)(now - time) >= 0;
+}
+
+static void scheduler_task(void* pvParam)
+{
+  ESP_LOGI(TAG, "Started scheduler task with %d jobs.", scheduler_job_count);
+
+  const TickType_t start = xTaskGetTickCount();
+  for (int index = 0; index < scheduler_job_count; ++index)
+  {
+    scheduler_jobs[index].next_run = start;
+  }
+
+  for (;;)
+  {
+    // Run everything that is due, jobs with the same period stay in step so they share a wake up
+    TickType_t now = xTaskGetTickCount();
+    for (int index = 0; index < scheduler_job_count; ++index)
+    {
+      scheduler_job_t* job = &scheduler_jobs[index];
+      if (scheduler_due(now, job->next_run))
+      {
+        job->fn();
+        job->next_run += job->period;
+
+        // Skip missed runs rather than running a job several times back to back to catch up
+        if (scheduler_due(now, job->next_run))
+        {
+          ESP_LOGW(TAG, "Job %s overran its %d ms period.", job->name, job->period * portTICK_PERIOD_MS);
+          job->next_run = now + job->period;
+        }
+      }
+    }
+
+    // Sleep until the next job is due
+    now = xTaskGetTickCount();
+    TickType_t delay = portMAX_DELAY;
+    for (int index = 0; index < scheduler_job_count; ++index)
+    {
+      const TickType_t wait = scheduler_due(now, scheduler_jobs[index].next_run) ? 0 : scheduler_jobs[index].next_run - now;
+      delay = wait < delay ? wait : delay;
+    }
+    if (delay > 0)
+    {
+      vTaskDelay(delay);
+    }
+  }
+}
+
+bool scheduler_add(const char* name, scheduler_job_fn_t fn, uint32_t period_ms)
+{
+  if (scheduler_job_count == SCHEDULER_MAX_JOBS)
+  {
+    ESP_LOGW(TAG, "No room for job %s.", name);
+    return false;
+  }
+
+  scheduler_job_t* job = &scheduler_jobs[scheduler_job_count++];
+  job->name = name;
+  job->fn = fn;
+  job->period = pdMS_TO_TICKS(period_ms) > 0 ? pdMS_TO_TICKS(period_ms) : 1;
+  return true;
+}
+
+void scheduler_start(void)
+{
+  // Big enough for the hungriest job, which used to have a 2 KB task to itself
+  xTaskCreate(scheduler_task, "scheduler-task", 2048, NULL, 6, NULL);
+}
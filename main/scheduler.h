@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Periodic job scheduler
+ *
+ * Small periodic jobs, like polling the button or sampling the battery, share one task instead of each having its own
+ * task or software timer. Jobs run one after another in that task, so they must be short and must not block.
+ */
+#define SCHEDULER_MAX_JOBS  8
+
+typedef void (*scheduler_job_fn_t)(void);
+
+// Register a job to run every period_ms, before scheduler_start, returns false if there is no room
+bool scheduler_add(const char* name, scheduler_job_fn_t fn, uint32_t period_ms);
+
+// Start the scheduler task, which runs every job straight away and then each time it is due
+void scheduler_start(void);
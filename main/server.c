@@ -1,3 +1,9 @@
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/timers.h"
+
 #include "esp_http_server.h"
 #include "esp_event.h"
 #include "esp_log.h"
@@ -5,10 +11,28 @@
 #include "esp_spiffs.h"
 #include "cJSON.h"
 
+#include "battery.h"
+#include "boot.h"
 #include "event.h"
 #include "hostname.h"
+#include "latency.h"
+#include "link.h"
+#include "mixer.h"
 #include "mount.h"
+#include "protocol.h"
+#include "server.h"
+#include "servo.h"
 #include "settings.h"
+#include "slew.h"
+#include "udp.h"
+
+#ifdef CONFIG_MLINK_UDP_CONTROL
+#include "lwip/sockets.h"
+#endif
+
+#ifdef CONFIG_MLINK_PROFILE_DECODE
+#include "driver/soc.h"
+#endif
 
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
 
@@ -23,24 +47,457 @@
 
 static const char* TAG = "m-link-http-server";
 
+#ifdef CONFIG_MLINK_PROFILE_DECODE
+/*
+ * Decode cycle counters, to compare the cost of the JSON and binary servo frame paths
+ */
+#define DECODE_PROFILE_FRAMES 256
+
+typedef struct
+{
+  const char* label;
+  uint32_t frames;
+  uint32_t cycles;
+  uint32_t max_cycles;
+}
+decode_profile_t;
+
+static decode_profile_t decode_profile_json = { .label = "json" };
+static decode_profile_t decode_profile_binary = { .label = "binary" };
+
+static void decode_profile_add(decode_profile_t* profile, uint32_t cycles)
+{
+  profile->cycles += cycles;
+  if (cycles > profile->max_cycles)
+  {
+    profile->max_cycles = cycles;
+  }
+
+  // Log the average once enough frames have been collected, then start again
+  if (++profile->frames == DECODE_PROFILE_FRAMES)
+  {
+    ESP_LOGI(TAG, "Decode %s: avg %u cycles, max %u cycles over %u frames",
+        profile->label, profile->cycles / profile->frames, profile->max_cycles, profile->frames);
+    profile->frames = 0;
+    profile->cycles = 0;
+    profile->max_cycles = 0;
+  }
+}
+#endif
+
+/*
+ * Heap counters for the WebSocket path, to check servo frames stay off the heap
+ */
+static uint32_t ws_heap_ops = 0;
+static uint32_t ws_fast_frames = 0;
+static uint32_t ws_slow_frames = 0;
+
+static void* ws_malloc(size_t size)
+{
+  ++ws_heap_ops;
+  return malloc(size);
+}
+
+static void ws_free(void* ptr)
+{
+  ++ws_heap_ops;
+  free(ptr);
+}
+
+/*
+ * Per-session WebSocket state, allocated on the first frame and released by the server when the socket closes
+ */
+#define WS_RX_BUFSIZE 512
+#define WS_MAX_SESSIONS 4
+
+/* Streaming sessions get a status frame at least this often, unless they ask otherwise */
+#define WS_DEFAULT_HEARTBEAT_MS 1000
+#define WS_MIN_HEARTBEAT_MS     100
+#define WS_PUSH_INTERVAL_MS     100
+
+/* Telemetry topics a session can subscribe to */
+#define WS_TOPIC_BATTERY  0x01
+#define WS_TOPIC_FAILSAFE 0x02
+#define WS_TOPIC_LINK     0x04
+
+#define WS_DEFAULT_TELEMETRY_MS 1000
+#define WS_MIN_TELEMETRY_MS     100
+
+/* Values last pushed to a subscribed session, only the subscribed topics are filled in */
+typedef struct
+{
+  int battery;
+  bool failsafe;
+  int failsafes[MLINK_BINARY_MAX_CHANNELS];
+  uint32_t drops;
+  uint32_t gaps;
+  uint16_t link_rate;
+  uint16_t link_p50_ms;
+  uint16_t link_p99_ms;
+  uint16_t link_failsafes;
+  uint32_t link_max_gap_ms;
+  int8_t link_ap_rssi;
+  uint8_t link_station_count;
+  int8_t link_station_rssi[LINK_MAX_STATIONS];
+}
+ws_telemetry_t;
+
+typedef struct
+{
+  /* Socket and server this session belongs to */
+  httpd_handle_t handle;
+  int fd;
+
+  /* Streaming mode - servo frames are not acknowledged */
+  bool streaming;
+  TickType_t heartbeat;
+  TickType_t last_push;
+  bool last_failsafe;
+
+  /* Ordering and loss statistics for sequence numbered servo frames */
+  sequence_state_t sequence;
+
+#ifdef CONFIG_MLINK_UDP_CONTROL
+  /* Token for the UDP control channel, zero if not enabled */
+  uint32_t udp_token;
+#endif
+
+  /* Telemetry subscriptions, pushed when a value changes or the period elapses */
+  uint8_t topics;
+  TickType_t telemetry_period;
+  TickType_t last_telemetry;
+  ws_telemetry_t telemetry;
+
+  /* Receive buffer reused for every frame that fits */
+  uint8_t rx_buf[WS_RX_BUFSIZE + 1];
+}
+ws_session_t;
+
+/* Open sessions, only touched from the httpd task */
+static ws_session_t* ws_sessions[WS_MAX_SESSIONS];
+
+/* Number of streaming sessions, read by the push timer */
+static volatile int ws_streaming_sessions = 0;
+
+/* Number of sessions with telemetry subscriptions, read by the telemetry task */
+static volatile int ws_telemetry_sessions = 0;
+
+static httpd_handle_t ws_server = NULL;
+
+/* Arrival time of the frame being handled, for latency stats */
+static uint32_t ws_frame_received;
+
+/* The session that owns the outputs, every other session is a spectator, only touched from the httpd task */
+static ws_session_t* ws_driver = NULL;
+
+static void ws_set_driver(ws_session_t* session)
+{
+#ifdef CONFIG_MLINK_UDP_CONTROL
+  // Only the driver may send UDP servo frames
+  if (ws_driver && ws_driver != session)
+  {
+    udp_unregister(ws_driver->udp_token);
+    ws_driver->udp_token = 0;
+  }
+#endif
+  // A new driver starts a new link statistics session
+  if (session && session != ws_driver)
+  {
+    link_reset();
+  }
+  ws_driver = session;
+}
+
+// Take the driver role if it is free, or if the driver has gone quiet long enough for failsafe to engage
+static bool ws_claim_driver(ws_session_t* session)
+{
+  if (session == ws_driver)
+  {
+    return true;
+  }
+  if (session && (!ws_driver || query_failsafe_engaged()))
+  {
+    ESP_LOGI(TAG, "Socket %d is now the driver", session->fd);
+    ws_set_driver(session);
+    return true;
+  }
+  return false;
+}
+
+// Servo frames are only applied from the driver, and then only if they are newer than the last one
+static bool ws_frame_accept(ws_session_t* session, const servo_frame_t* frame)
+{
+  return ws_claim_driver(session) && (!session || protocol_sequence_accept(&session->sequence, frame));
+}
+
+// Format a status message, with the request ID and last applied sequence number when there are any
+static int ws_format_status(char* buffer, size_t size, ws_session_t* session, const char* event, const servo_frame_t* frame)
+{
+  int len = snprintf(buffer, size, "{");
+  if (event)
+  {
+    len += snprintf(buffer + len, size - len, "\"event\":\"%s\",", event);
+  }
+  if (frame && frame->has_id)
+  {
+    len += snprintf(buffer + len, size - len, "\"id\":\"%u\",", frame->id);
+  }
+  if (session && session != ws_driver)
+  {
+    len += snprintf(buffer + len, size - len, "\"role\":\"spectator\",");
+  }
+  if (session && session->sequence.valid)
+  {
+    len += snprintf(buffer + len, size - len, "\"seq\":\"%u\",", session->sequence.last);
+  }
+  len += snprintf(buffer + len, size - len, "\"status\":\"%s\"}", query_failsafe_engaged() ? "failsafe" : "ok");
+  return len;
+}
+
+// Add an integer to an object as a string
+// TODO: Figure out why cJSON_Print crashes on numbers!
+static void add_number_string(cJSON* object, const char* key, int value)
+{
+  char number_buffer[16];
+  snprintf(number_buffer, sizeof(number_buffer), "%d", value);
+  cJSON_AddItemToObject(object, key, cJSON_CreateString(number_buffer));
+}
+
+static void add_unsigned_string(cJSON* object, const char* key, uint32_t value)
+{
+  char number_buffer[16];
+  snprintf(number_buffer, sizeof(number_buffer), "%u", value);
+  cJSON_AddItemToObject(object, key, cJSON_CreateString(number_buffer));
+}
+
+// Read a whole number that fits in 32 bits, like the fast path does, casting anything else would be undefined
+static bool ws_get_uint32(const cJSON* item, uint32_t* value)
+{
+  if (!cJSON_IsNumber(item) || !(item->valuedouble >= 0 && item->valuedouble <= UINT32_MAX) ||
+      item->valuedouble != (double)(uint32_t)item->valuedouble)
+  {
+    return false;
+  }
+  *value = (uint32_t)item->valuedouble;
+  return true;
+}
+
+// Collect an array of values, spread over the channels in an optional mask
+static bool ws_decode_values(cJSON* root, cJSON* array, const char* mask_key, servo_frame_t* frame)
+{
+  int count = 0;
+  cJSON* value = NULL;
+  cJSON_ArrayForEach(value, array)
+  {
+    if (cJSON_IsNumber(value) && count < MLINK_BINARY_MAX_CHANNELS)
+    {
+      frame->values[count++] = value->valueint;
+    }
+  }
+
+  cJSON* mask = cJSON_GetObjectItem(root, mask_key);
+  if (cJSON_IsNumber(mask))
+  {
+    return protocol_unpack_mask(frame, (uint16_t)mask->valueint, count);
+  }
+  return protocol_unpack_mask(frame, (uint16_t)((1u << count) - 1), count);
+}
+
+// Read up to count integers from an array into values, leaving any missing ones untouched, returns false if any entry
+// is not a number in the int16 range so nothing wraps on the way into the mixer configuration
+static bool ws_read_int16s(cJSON* array, int16_t* values, int count)
+{
+  int index = 0;
+  cJSON* value = NULL;
+  cJSON_ArrayForEach(value, array)
+  {
+    if (!cJSON_IsNumber(value) || value->valueint < INT16_MIN || value->valueint > INT16_MAX)
+    {
+      return false;
+    }
+    if (index < count)
+    {
+      values[index++] = value->valueint;
+    }
+  }
+  return true;
+}
+
+static cJSON* create_int16_array(const int16_t* values, int count)
+{
+  char number_buffer[16];
+  cJSON* array = cJSON_CreateArray();
+  for (int index = 0; index < count; ++index)
+  {
+    snprintf(number_buffer, sizeof(number_buffer), "%d", values[index]);
+    cJSON_AddItemToArray(array, cJSON_CreateString(number_buffer));
+  }
+  return array;
+}
+
+// Update the mixer from the keys present in a {"mixer":{...}} request, any missing key keeps its current value
+static bool ws_update_mixer(cJSON* request)
+{
+  mixer_config_t config;
+  mixer_get_config(&config);
+  bool valid = true;
+
+  cJSON* mix = cJSON_GetObjectItem(request, "mix");
+  if (cJSON_IsArray(mix))
+  {
+    int channel = 0;
+    cJSON* row = NULL;
+    cJSON_ArrayForEach(row, mix)
+    {
+      if (channel < MIXER_CHANNELS)
+      {
+        valid &= cJSON_IsArray(row) && ws_read_int16s(row, config.mix[channel++], MIXER_AXES);
+      }
+    }
+  }
+
+  const struct
+  {
+    const char* key;
+    int16_t* values;
+  }
+  arrays[] = {
+    { "trim", config.trim },
+    { "min", config.min },
+    { "max", config.max },
+    { "expo", config.expo },
+  };
+  for (int index = 0; index < sizeof(arrays) / sizeof(arrays[0]); ++index)
+  {
+    cJSON* array = cJSON_GetObjectItem(request, arrays[index].key);
+    if (array)
+    {
+      valid &= cJSON_IsArray(array) && ws_read_int16s(array, arrays[index].values, MIXER_CHANNELS);
+    }
+  }
+
+  cJSON* reverse_mask = cJSON_GetObjectItem(request, "reverse_mask");
+  if (cJSON_IsNumber(reverse_mask))
+  {
+    valid &= reverse_mask->valueint >= 0 && reverse_mask->valueint <= UINT16_MAX;
+    config.reverse_mask = reverse_mask->valueint;
+  }
+
+  // Ranges and endpoints are checked by the mixer, which leaves the old configuration in place if they are wrong
+  return valid && mixer_set_config(&config);
+}
+
+static void add_mixer(cJSON* response)
+{
+  mixer_config_t config;
+  mixer_get_config(&config);
+
+  cJSON* mixer = cJSON_CreateObject();
+  cJSON* mix = cJSON_CreateArray();
+  for (int channel = 0; channel < MIXER_CHANNELS; ++channel)
+  {
+    cJSON_AddItemToArray(mix, create_int16_array(config.mix[channel], MIXER_AXES));
+  }
+  cJSON_AddItemToObject(mixer, "mix", mix);
+  cJSON_AddItemToObject(mixer, "trim", create_int16_array(config.trim, MIXER_CHANNELS));
+  cJSON_AddItemToObject(mixer, "min", create_int16_array(config.min, MIXER_CHANNELS));
+  cJSON_AddItemToObject(mixer, "max", create_int16_array(config.max, MIXER_CHANNELS));
+  cJSON_AddItemToObject(mixer, "expo", create_int16_array(config.expo, MIXER_CHANNELS));
+  add_number_string(mixer, "reverse_mask", config.reverse_mask);
+  cJSON_AddItemToObject(response, "mixer", mixer);
+}
+
+// Update output smoothing from the keys present in a {"slew":{...}} request, any missing key keeps its current value
+static bool ws_update_slew(cJSON* request)
+{
+  slew_config_t config;
+  slew_get_config(&config);
+  bool valid = true;
+
+  cJSON* rate = cJSON_GetObjectItem(request, "rate");
+  if (rate)
+  {
+    valid &= cJSON_IsArray(rate) && ws_read_int16s(rate, config.rate, SLEW_CHANNELS);
+  }
+
+  cJSON* interpolate_mask = cJSON_GetObjectItem(request, "interpolate_mask");
+  if (cJSON_IsNumber(interpolate_mask))
+  {
+    valid &= interpolate_mask->valueint >= 0 && interpolate_mask->valueint <= UINT16_MAX;
+    config.interpolate_mask = interpolate_mask->valueint;
+  }
+
+  return valid && slew_set_config(&config);
+}
+
+static void add_slew(cJSON* response)
+{
+  slew_config_t config;
+  slew_get_config(&config);
+
+  cJSON* slew = cJSON_CreateObject();
+  cJSON_AddItemToObject(slew, "rate", create_int16_array(config.rate, SLEW_CHANNELS));
+  add_number_string(slew, "interpolate_mask", config.interpolate_mask);
+  cJSON_AddItemToObject(response, "slew", slew);
+}
+
 /*
  * M-Link WebSocket handler
  */
-static void process_ws_payload(cJSON* root, cJSON* response)
+static void process_ws_payload(cJSON* root, cJSON* response, ws_session_t* session)
 {
-  // Extract servo data
+  // Echo the request ID so the client can match the response
+  cJSON* id = cJSON_GetObjectItem(root, "id");
+  uint32_t numeric_id;
+  if (ws_get_uint32(id, &numeric_id))
+  {
+    add_unsigned_string(response, "id", numeric_id);
+  }
+  else if (cJSON_IsNumber(id))
+  {
+    ESP_LOGW(TAG, "Request ID out of range, not echoing it.");
+  }
+  else if (cJSON_IsString(id))
+  {
+    cJSON_AddItemToObject(response, "id", cJSON_CreateString(id->valuestring));
+  }
+
+  // Extract servo data, given either as pulse widths or as mixer axes
   cJSON* servos = cJSON_GetObjectItem(root, "servos");
-  cJSON* servo = NULL;
+  const bool axes = !servos;
+  if (axes)
+  {
+    servos = cJSON_GetObjectItem(root, "axes");
+  }
   if (cJSON_IsArray(servos))
   {
-    // Process servo data
-    int index = 0;
-    cJSON_ArrayForEach(servo, servos)
+    servo_frame_t frame = { .received = ws_frame_received, .axes = axes };
+    if (ws_decode_values(root, servos, "servo_mask", &frame))
     {
-      if (cJSON_IsNumber(servo))
+      frame.decoded = latency_now();
+
+      // Optional sequence number, a frame whose sequence number can't be ordered is dropped rather than guessed at
+      cJSON* seq = cJSON_GetObjectItem(root, "seq");
+      bool seq_valid = true;
+      if (seq)
+      {
+        frame.has_seq = true;
+        seq_valid = ws_get_uint32(seq, &frame.seq);
+      }
+
+      // Process servo data, unless it is older than the last frame applied
+      if (!seq_valid)
       {
-        process_servo_event(index++, servo->valueint);
+        ESP_LOGW(TAG, "Servo frame sequence number out of range, ignoring.");
       }
+      else if (ws_frame_accept(session, &frame))
+      {
+        protocol_apply(&frame);
+      }
+    }
+    else
+    {
+      ESP_LOGW(TAG, "Servo values don't match servo_mask, ignoring.");
     }
 
     // Early out to avoid chewing up cycles - only if no other elements
@@ -52,23 +509,67 @@ static void process_ws_payload(cJSON* root, cJSON* response)
 
   // Extract failsafe data
   cJSON* failsafes = cJSON_GetObjectItem(root, "failsafes");
-  cJSON* failsafe = NULL;
   if (cJSON_IsArray(failsafes))
   {
     // Process failsafe data
-    int index = 0;
-    cJSON_ArrayForEach(failsafe, failsafes)
+    servo_frame_t frame = {};
+    if (session && ws_driver && session != ws_driver)
     {
-      if (cJSON_IsNumber(failsafe))
-      {
-        process_failsafe_event(index, failsafe->valueint);
-      }
+      ESP_LOGW(TAG, "Ignoring failsafes from spectator socket %d.", session->fd);
+    }
+    else if (ws_decode_values(root, failsafes, "failsafe_mask", &frame))
+    {
+      process_failsafe_frame(frame.mask, frame.values);
+    }
+    else
+    {
+      ESP_LOGW(TAG, "Failsafe values don't match failsafe_mask, ignoring.");
+    }
+  }
+
+  // Configure the mixer
+  cJSON* mixer = cJSON_GetObjectItem(root, "mixer");
+  if (cJSON_IsObject(mixer))
+  {
+    if (session && ws_driver && session != ws_driver)
+    {
+      ESP_LOGW(TAG, "Ignoring mixer configuration from spectator socket %d.", session->fd);
+    }
+    else if (ws_update_mixer(mixer))
+    {
+      ESP_LOGI(TAG, "Updated mixer configuration");
+    }
+    else
+    {
+      ESP_LOGW(TAG, "Ignoring invalid mixer configuration.");
+    }
+  }
+
+  // Configure output smoothing
+  cJSON* slew = cJSON_GetObjectItem(root, "slew");
+  if (cJSON_IsObject(slew))
+  {
+    if (session && ws_driver && session != ws_driver)
+    {
+      ESP_LOGW(TAG, "Ignoring slew configuration from spectator socket %d.", session->fd);
+    }
+    else if (ws_update_slew(slew))
+    {
+      ESP_LOGI(TAG, "Updated slew configuration");
+    }
+    else
+    {
+      ESP_LOGW(TAG, "Ignoring invalid slew configuration.");
     }
   }
 
   // Apply settings?
   cJSON* settings = cJSON_GetObjectItem(root, "settings");
-  if (settings)
+  if (settings && session && ws_driver && session != ws_driver)
+  {
+    ESP_LOGW(TAG, "Ignoring settings from spectator socket %d.", session->fd);
+  }
+  else if (settings)
   {
     bool any_updates = false;
     cJSON* name = cJSON_GetObjectItem(settings, "name");
@@ -106,10 +607,68 @@ static void process_ws_payload(cJSON* root, cJSON* response)
       settings_set_password(password->valuestring);
       any_updates = true;
     }
+    cJSON* pwm_modes = cJSON_GetObjectItem(settings, "pwm_modes");
+    if (cJSON_IsString(pwm_modes))
+    {
+      // Modes take effect straight away, and are only saved if they are valid
+      if (servo_set_modes(pwm_modes->valuestring))
+      {
+        ESP_LOGI(TAG, "Set PWM modes to %s", pwm_modes->valuestring);
+        settings_set_pwm_modes(pwm_modes->valuestring);
+        any_updates = true;
+      }
+      else
+      {
+        ESP_LOGW(TAG, "Ignoring invalid PWM modes %s", pwm_modes->valuestring);
+      }
+    }
+    cJSON* failsafe_timeout = cJSON_GetObjectItem(settings, "failsafe_timeout");
+    if (cJSON_IsNumber(failsafe_timeout))
+    {
+      // Takes effect on rx_task's next check
+      const int timeout = failsafe_timeout->valueint;
+      if (settings_set_failsafe_timeout(timeout))
+      {
+        ESP_LOGI(TAG, "Set failsafe timeout to %d ms", timeout);
+        any_updates = true;
+      }
+      else
+      {
+        ESP_LOGW(TAG, "Ignoring invalid failsafe timeout %d ms", timeout);
+      }
+    }
+    cJSON* failsafe_ramp = cJSON_GetObjectItem(settings, "failsafe_ramp");
+    if (cJSON_IsNumber(failsafe_ramp))
+    {
+      const int ramp = failsafe_ramp->valueint;
+      if (settings_set_failsafe_ramp(ramp))
+      {
+        ESP_LOGI(TAG, "Set failsafe ramp to %d ms", ramp);
+        any_updates = true;
+      }
+      else
+      {
+        ESP_LOGW(TAG, "Ignoring invalid failsafe ramp %d ms", ramp);
+      }
+    }
     if (any_updates)
     {
-      ESP_LOGI(TAG, "Writing settings");
-      settings_write();
+      // Saved in the background once the outputs are idle, as a flash erase would stall this task
+      ESP_LOGI(TAG, "Settings updated");
+    }
+  }
+
+  // Calibrate the battery reading against a measured voltage in millivolts
+  cJSON* calibrate_battery = cJSON_GetObjectItem(root, "calibrate_battery");
+  if (cJSON_IsNumber(calibrate_battery))
+  {
+    if (session && ws_driver && session != ws_driver)
+    {
+      ESP_LOGW(TAG, "Ignoring battery calibration from spectator socket %d.", session->fd);
+    }
+    else if (!battery_calibrate(calibrate_battery->valueint))
+    {
+      ESP_LOGW(TAG, "Unable to calibrate battery to %d mV.", calibrate_battery->valueint);
     }
   }
 
@@ -117,7 +676,11 @@ static void process_ws_payload(cJSON* root, cJSON* response)
   cJSON* reset_settings = cJSON_GetObjectItem(root, "reset_settings");
   if (reset_settings)
   {
-    if (cJSON_IsString(reset_settings) && strcmp(reset_settings->valuestring,  "sgnittes_teser") == 0)
+    if (session && ws_driver && session != ws_driver)
+    {
+      ESP_LOGW(TAG, "Ignoring settings reset from spectator socket %d.", session->fd);
+    }
+    else if (cJSON_IsString(reset_settings) && strcmp(reset_settings->valuestring,  "sgnittes_teser") == 0)
     {
       ESP_LOGI(TAG, "Restoring default settings");
       settings_reset_defaults();
@@ -128,13 +691,152 @@ static void process_ws_payload(cJSON* root, cJSON* response)
   cJSON* reboot = cJSON_GetObjectItem(root, "reboot");
   if (reboot)
   {
-    if (cJSON_IsString(reboot) && strcmp(reboot->valuestring,  "toober") == 0)
+    if (session && ws_driver && session != ws_driver)
+    {
+      ESP_LOGW(TAG, "Ignoring reboot from spectator socket %d.", session->fd);
+    }
+    else if (cJSON_IsString(reboot) && strcmp(reboot->valuestring,  "toober") == 0)
     {
       ESP_LOGI(TAG, "Rebooting");
+      settings_commit();
+      mixer_commit();
+      slew_commit();
+      battery_commit();
       esp_restart();
     }
   }
 
+  // Switch streaming mode on or off
+  cJSON* stream = cJSON_GetObjectItem(root, "stream");
+  if (cJSON_IsBool(stream) && session)
+  {
+    const bool streaming = cJSON_IsTrue(stream);
+    if (streaming != session->streaming)
+    {
+      ws_streaming_sessions += streaming ? 1 : -1;
+    }
+    session->streaming = streaming;
+
+    int heartbeat_ms = WS_DEFAULT_HEARTBEAT_MS;
+    cJSON* heartbeat = cJSON_GetObjectItem(root, "heartbeat");
+    if (cJSON_IsNumber(heartbeat))
+    {
+      heartbeat_ms = heartbeat->valueint < WS_MIN_HEARTBEAT_MS ? WS_MIN_HEARTBEAT_MS : heartbeat->valueint;
+    }
+    session->heartbeat = pdMS_TO_TICKS(heartbeat_ms);
+    session->last_push = xTaskGetTickCount();
+    session->last_failsafe = query_failsafe_engaged();
+
+    ESP_LOGI(TAG, "Streaming %s for socket %d", streaming ? "enabled" : "disabled", session->fd);
+    cJSON_AddItemToObject(response, "stream", cJSON_CreateString(streaming ? "on" : "off"));
+  }
+
+  // Claim or give up the driver role
+  cJSON* role = cJSON_GetObjectItem(root, "role");
+  if (cJSON_IsString(role) && session)
+  {
+    if (strcmp(role->valuestring, "driver") == 0)
+    {
+      ws_claim_driver(session);
+    }
+    else if (strcmp(role->valuestring, "spectator") == 0 && session == ws_driver)
+    {
+      ESP_LOGI(TAG, "Socket %d is now a spectator", session->fd);
+      ws_set_driver(NULL);
+    }
+  }
+  if (role && session)
+  {
+    cJSON_AddItemToObject(response, "role", cJSON_CreateString(session == ws_driver ? "driver" : "spectator"));
+  }
+
+  // Subscribe to telemetry topics, an empty list unsubscribes
+  cJSON* subscribe = cJSON_GetObjectItem(root, "subscribe");
+  if (cJSON_IsArray(subscribe) && session)
+  {
+    uint8_t topics = 0;
+    cJSON* subscribed = cJSON_CreateArray();
+    cJSON* topic = NULL;
+    cJSON_ArrayForEach(topic, subscribe)
+    {
+      uint8_t bit = 0;
+      if (cJSON_IsString(topic))
+      {
+        if (strcmp(topic->valuestring, "battery") == 0)
+        {
+          bit = WS_TOPIC_BATTERY;
+        }
+        else if (strcmp(topic->valuestring, "failsafe") == 0)
+        {
+          bit = WS_TOPIC_FAILSAFE;
+        }
+        else if (strcmp(topic->valuestring, "link") == 0)
+        {
+          bit = WS_TOPIC_LINK;
+        }
+      }
+      if (bit && !(topics & bit))
+      {
+        topics |= bit;
+        cJSON_AddItemToArray(subscribed, cJSON_CreateString(topic->valuestring));
+      }
+    }
+    if (!topics != !session->topics)
+    {
+      ws_telemetry_sessions += topics ? 1 : -1;
+    }
+    session->topics = topics;
+
+    int rate_ms = WS_DEFAULT_TELEMETRY_MS;
+    cJSON* rate = cJSON_GetObjectItem(root, "rate");
+    if (cJSON_IsNumber(rate))
+    {
+      rate_ms = rate->valueint < WS_MIN_TELEMETRY_MS ? WS_MIN_TELEMETRY_MS : rate->valueint;
+    }
+    session->telemetry_period = pdMS_TO_TICKS(rate_ms);
+
+    // Push the first update straight away
+    session->last_telemetry = xTaskGetTickCount() - session->telemetry_period;
+
+    cJSON_AddItemToObject(response, "subscribe", subscribed);
+  }
+
+#ifdef CONFIG_MLINK_UDP_CONTROL
+  // Enable or disable the UDP control channel for the driver, tokens are only valid from this session's address
+  cJSON* udp = cJSON_GetObjectItem(root, "udp");
+  if (cJSON_IsBool(udp) && session)
+  {
+    udp_unregister(session->udp_token);
+    session->udp_token = 0;
+
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (cJSON_IsTrue(udp) && ws_claim_driver(session) && getpeername(session->fd, (struct sockaddr*)&peer, &peer_len) == 0 && peer.sin_family == AF_INET)
+    {
+      uint32_t token;
+      do
+      {
+        token = esp_random();
+      }
+      while (!token);
+
+      if (udp_register(token, peer.sin_addr.s_addr))
+      {
+        session->udp_token = token;
+      }
+    }
+
+    cJSON* channel = cJSON_CreateObject();
+    if (session->udp_token)
+    {
+      add_unsigned_string(channel, "port", udp_get_port());
+      add_unsigned_string(channel, "token", session->udp_token);
+    }
+    ESP_LOGI(TAG, "UDP control %s for socket %d", session->udp_token ? "enabled" : "disabled", session->fd);
+    cJSON_AddItemToObject(response, "udp", channel);
+  }
+#endif
+
   // Handle queries
   cJSON* query= cJSON_GetObjectItem(root, "query");
   if (cJSON_IsString(query))
@@ -148,6 +850,150 @@ static void process_ws_payload(cJSON* root, cJSON* response)
       voltage_buffer[15] = '\0';
       cJSON* voltage = cJSON_CreateString(voltage_buffer);
       cJSON_AddItemToObject(response, "battery", voltage);
+
+      // Sag since the tracker was last reset, and the raw reading for calibration
+      battery_reading_t reading;
+      battery_get_reading(&reading);
+      cJSON* sag = cJSON_CreateObject();
+      add_number_string(sag, "min", reading.min_mv);
+      add_number_string(sag, "max", reading.max_mv);
+      add_number_string(sag, "raw", reading.raw);
+      cJSON_AddItemToObject(response, "battery_sag", sag);
+      if (cJSON_IsTrue(cJSON_GetObjectItem(root, "reset")))
+      {
+        battery_reset_sag();
+      }
+    }
+
+    // Querying heap usage?
+    if (strcmp(query->valuestring, "heap") == 0)
+    {
+      cJSON* heap = cJSON_CreateObject();
+      add_number_string(heap, "free", esp_get_free_heap_size());
+      add_number_string(heap, "min_free", esp_get_minimum_free_heap_size());
+      add_number_string(heap, "ws_heap_ops", ws_heap_ops);
+      add_number_string(heap, "ws_fast_frames", ws_fast_frames);
+      add_number_string(heap, "ws_slow_frames", ws_slow_frames);
+      cJSON_AddItemToObject(response, "heap", heap);
+    }
+
+#ifdef CONFIG_MLINK_LATENCY_STATS
+    // Querying control latency histograms?
+    if (strcmp(query->valuestring, "stats") == 0)
+    {
+      latency_histogram_t histograms[LATENCY_STAGES];
+      latency_get_stats(histograms, cJSON_IsTrue(cJSON_GetObjectItem(root, "reset")));
+      cJSON* stats = cJSON_CreateObject();
+      for (int stage = 0; stage < LATENCY_STAGES; ++stage)
+      {
+        cJSON* histogram = cJSON_CreateObject();
+        add_unsigned_string(histogram, "count", histograms[stage].count);
+        add_unsigned_string(histogram, "max_us", histograms[stage].max_us);
+        cJSON* buckets = cJSON_CreateArray();
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+        {
+          char number_buffer[16];
+          snprintf(number_buffer, sizeof(number_buffer), "%u", histograms[stage].buckets[bucket]);
+          cJSON_AddItemToArray(buckets, cJSON_CreateString(number_buffer));
+        }
+        cJSON_AddItemToObject(histogram, "buckets", buckets);
+        cJSON_AddItemToObject(stats, latency_stage_name(stage), histogram);
+      }
+      cJSON_AddItemToObject(response, "stats", stats);
+    }
+#endif
+
+#ifdef CONFIG_MLINK_UDP_CONTROL
+    // Querying UDP control channel statistics?
+    if (strcmp(query->valuestring, "udp") == 0)
+    {
+      udp_stats_t stats;
+      udp_get_stats(&stats, cJSON_IsTrue(cJSON_GetObjectItem(root, "reset")));
+      cJSON* udp_stats = cJSON_CreateObject();
+      add_unsigned_string(udp_stats, "frames", stats.frames);
+      add_unsigned_string(udp_stats, "stale", stats.stale);
+      add_unsigned_string(udp_stats, "rejected", stats.rejected);
+      add_unsigned_string(udp_stats, "max_gap_ms", stats.max_gap_ms);
+      cJSON_AddItemToObject(response, "udp", udp_stats);
+    }
+#endif
+
+    // Querying link quality for this driving session?
+    if (strcmp(query->valuestring, "link") == 0)
+    {
+      link_stats_t stats;
+      link_get_stats(&stats, cJSON_IsTrue(cJSON_GetObjectItem(root, "reset")));
+      cJSON* link = cJSON_CreateObject();
+      add_unsigned_string(link, "frames", stats.frames);
+      add_unsigned_string(link, "rate", stats.rate);
+      add_unsigned_string(link, "p50_ms", stats.p50_ms);
+      add_unsigned_string(link, "p99_ms", stats.p99_ms);
+      add_unsigned_string(link, "max_gap_ms", stats.max_gap_ms);
+      add_unsigned_string(link, "failsafes", stats.failsafes);
+      if (stats.ap_rssi)
+      {
+        add_number_string(link, "ap_rssi", stats.ap_rssi);
+      }
+      cJSON* stations = cJSON_CreateArray();
+      for (int index = 0; index < stats.station_count; ++index)
+      {
+        const uint8_t* mac = stats.stations[index].mac;
+        char mac_buffer[18];
+        snprintf(mac_buffer, sizeof(mac_buffer), "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        cJSON* station = cJSON_CreateObject();
+        cJSON_AddItemToObject(station, "mac", cJSON_CreateString(mac_buffer));
+        add_number_string(station, "rssi", stats.stations[index].rssi);
+        cJSON_AddItemToArray(stations, station);
+      }
+      cJSON_AddItemToObject(link, "stations", stations);
+      cJSON_AddItemToObject(response, "link", link);
+    }
+
+    // Querying the boot timeline?
+    if (strcmp(query->valuestring, "boot") == 0)
+    {
+      boot_stage_t stages[BOOT_MAX_STAGES];
+      const int count = boot_get_stages(stages);
+      cJSON* boot = cJSON_CreateObject();
+      cJSON_AddItemToObject(boot, "reset_reason", cJSON_CreateString(boot_reset_reason()));
+      cJSON* timeline = cJSON_CreateArray();
+      for (int index = 0; index < count; ++index)
+      {
+        cJSON* stage = cJSON_CreateObject();
+        cJSON_AddItemToObject(stage, "name", cJSON_CreateString(stages[index].name));
+        add_unsigned_string(stage, "us", stages[index].end_us - (index ? stages[index - 1].end_us : 0));
+        add_unsigned_string(stage, "end_us", stages[index].end_us);
+        cJSON_AddItemToArray(timeline, stage);
+      }
+      cJSON_AddItemToObject(boot, "stages", timeline);
+      const uint32_t first_frame_us = boot_get_first_frame_us();
+      if (first_frame_us)
+      {
+        add_unsigned_string(boot, "first_frame_us", first_frame_us);
+      }
+      cJSON_AddItemToObject(response, "boot", boot);
+    }
+
+    // Querying sequence statistics for this session?
+    if (strcmp(query->valuestring, "sequence") == 0 && session)
+    {
+      cJSON* sequence = cJSON_CreateObject();
+      add_unsigned_string(sequence, "last", session->sequence.last);
+      add_unsigned_string(sequence, "drops", session->sequence.drops);
+      add_unsigned_string(sequence, "gaps", session->sequence.gaps);
+      cJSON_AddItemToObject(response, "sequence", sequence);
+    }
+
+    // Querying the mixer configuration?
+    if (strcmp(query->valuestring, "mixer") == 0)
+    {
+      add_mixer(response);
+    }
+
+    // Querying the output smoothing configuration?
+    if (strcmp(query->valuestring, "slew") == 0)
+    {
+      add_slew(response);
     }
 
     // Querying failsafe?
@@ -206,11 +1052,307 @@ static void process_ws_payload(cJSON* root, cJSON* response)
           cJSON_AddItemToObject(settings, "password", password);
         }
       }
+      {
+        cJSON* pwm_modes = cJSON_CreateString(settings_get_pwm_modes());
+        if (pwm_modes)
+        {
+          cJSON_AddItemToObject(settings, "pwm_modes", pwm_modes);
+        }
+      }
+      add_number_string(settings, "failsafe_timeout", settings_get_failsafe_timeout());
+      add_number_string(settings, "failsafe_ramp", settings_get_failsafe_ramp());
+      cJSON* failsafes = cJSON_CreateArray();
+      for (int channel = 0; channel < query_supported_channels(); ++channel)
+      {
+        char failsafe_buffer[16];
+        snprintf(failsafe_buffer, sizeof(failsafe_buffer), "%d", query_failsafe(channel));
+        cJSON_AddItemToArray(failsafes, cJSON_CreateString(failsafe_buffer));
+      }
+      cJSON_AddItemToObject(settings, "failsafes", failsafes);
       cJSON_AddItemToObject(response, "settings", settings);
+
+      // Advertise optional protocol features
+      cJSON* features = cJSON_CreateArray();
+      cJSON_AddItemToArray(features, cJSON_CreateString("binary"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("stream"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("seq"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("mask"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("id"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("telemetry"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("role"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("mixer"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("slew"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("battery_sag"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("link"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("saved_failsafes"));
+      cJSON_AddItemToArray(features, cJSON_CreateString("boot"));
+#ifdef CONFIG_MLINK_LATENCY_STATS
+      cJSON_AddItemToArray(features, cJSON_CreateString("stats"));
+#endif
+#ifdef CONFIG_MLINK_UDP_CONTROL
+      cJSON_AddItemToArray(features, cJSON_CreateString("udp"));
+#endif
+      cJSON_AddItemToObject(response, "features", features);
     }
   }
 }
 
+static void ws_session_free(void* ctx)
+{
+  ws_session_t* session = (ws_session_t*)ctx;
+  for (int i = 0; i < WS_MAX_SESSIONS; ++i)
+  {
+    if (ws_sessions[i] == session)
+    {
+      ws_sessions[i] = NULL;
+    }
+  }
+  if (session->streaming)
+  {
+    --ws_streaming_sessions;
+  }
+  if (session->topics)
+  {
+    --ws_telemetry_sessions;
+  }
+#ifdef CONFIG_MLINK_UDP_CONTROL
+  udp_unregister(session->udp_token);
+#endif
+  if (ws_driver == session)
+  {
+    ESP_LOGI(TAG, "Driver socket %d closed", session->fd);
+    ws_driver = NULL;
+  }
+  ws_free(session);
+}
+
+static ws_session_t* ws_session_get(httpd_req_t* req)
+{
+  ws_session_t* session = (ws_session_t*)req->sess_ctx;
+  if (!session)
+  {
+    session = ws_malloc(sizeof(ws_session_t));
+    if (session)
+    {
+      memset(session, 0, offsetof(ws_session_t, rx_buf));
+      session->handle = req->handle;
+      session->fd = httpd_req_to_sockfd(req);
+      for (int i = 0; i < WS_MAX_SESSIONS; ++i)
+      {
+        if (!ws_sessions[i])
+        {
+          ws_sessions[i] = session;
+          break;
+        }
+      }
+      httpd_sess_set_ctx(req->handle, session->fd, session, ws_session_free);
+      /* Keep the request in step so the context isn't freed when the handler returns */
+      req->sess_ctx = session;
+      req->free_ctx = ws_session_free;
+    }
+  }
+  return session;
+}
+
+static void ws_send_status_async(ws_session_t* session)
+{
+  char status_buffer[96];
+  ws_format_status(status_buffer, sizeof(status_buffer), session, "status", NULL);
+  httpd_ws_frame_t status_pkt = {
+    .final = false,
+    .fragmented = false,
+    .type = HTTPD_WS_TYPE_TEXT,
+    .payload = (unsigned char*)status_buffer,
+    .len = strlen(status_buffer)
+  };
+  esp_err_t ret = httpd_ws_send_frame_async(session->handle, session->fd, &status_pkt);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "httpd_ws_send_frame_async failed with %d", ret);
+  }
+}
+
+/* Push status to streaming sessions when failsafe changes or a heartbeat is due, runs on the httpd task */
+static void ws_push_status(void* arg)
+{
+  const bool failsafe = query_failsafe_engaged();
+  const TickType_t now = xTaskGetTickCount();
+  for (int i = 0; i < WS_MAX_SESSIONS; ++i)
+  {
+    ws_session_t* session = ws_sessions[i];
+    if (session && session->streaming)
+    {
+      if (failsafe != session->last_failsafe || now - session->last_push >= session->heartbeat)
+      {
+        ws_send_status_async(session);
+        session->last_failsafe = failsafe;
+        session->last_push = now;
+      }
+    }
+  }
+}
+
+// Read the current values of some telemetry topics, link statistics come from the driver
+static void ws_read_telemetry(uint8_t topics, ws_telemetry_t* telemetry)
+{
+  memset(telemetry, 0, sizeof(*telemetry));
+  if (topics & WS_TOPIC_BATTERY)
+  {
+    telemetry->battery = query_battery_voltage();
+  }
+  telemetry->failsafe = query_failsafe_engaged();
+  if (topics & WS_TOPIC_FAILSAFE)
+  {
+    for (int channel = 0; channel < query_supported_channels() && channel < MLINK_BINARY_MAX_CHANNELS; ++channel)
+    {
+      telemetry->failsafes[channel] = query_failsafe(channel);
+    }
+  }
+  if ((topics & WS_TOPIC_LINK) && ws_driver)
+  {
+    telemetry->drops = ws_driver->sequence.drops;
+    telemetry->gaps = ws_driver->sequence.gaps;
+  }
+  if (topics & WS_TOPIC_LINK)
+  {
+    // Copied field by field, the frame count changes with every frame and would push on every check
+    link_stats_t stats;
+    link_get_stats(&stats, false);
+    telemetry->link_rate = stats.rate;
+    telemetry->link_p50_ms = stats.p50_ms;
+    telemetry->link_p99_ms = stats.p99_ms;
+    telemetry->link_failsafes = stats.failsafes;
+    telemetry->link_max_gap_ms = stats.max_gap_ms;
+    telemetry->link_ap_rssi = stats.ap_rssi;
+    telemetry->link_station_count = stats.station_count;
+    for (int index = 0; index < stats.station_count; ++index)
+    {
+      telemetry->link_station_rssi[index] = stats.stations[index].rssi;
+    }
+  }
+}
+
+static int ws_format_telemetry(char* buffer, size_t size, uint8_t topics, const ws_telemetry_t* telemetry)
+{
+  int len = snprintf(buffer, size, "{\"event\":\"telemetry\",");
+  if (topics & WS_TOPIC_BATTERY)
+  {
+    len += snprintf(buffer + len, size - len, "\"battery\":\"%d\",", telemetry->battery);
+  }
+  if (topics & WS_TOPIC_FAILSAFE)
+  {
+    len += snprintf(buffer + len, size - len, "\"failsafes\":[");
+    for (int channel = 0; channel < query_supported_channels() && channel < MLINK_BINARY_MAX_CHANNELS; ++channel)
+    {
+      len += snprintf(buffer + len, size - len, "%s\"%d\"", channel ? "," : "", telemetry->failsafes[channel]);
+    }
+    len += snprintf(buffer + len, size - len, "],");
+  }
+  if (topics & WS_TOPIC_LINK)
+  {
+    len += snprintf(buffer + len, size - len, "\"sequence\":{\"last\":\"%u\",\"drops\":\"%u\",\"gaps\":\"%u\"},",
+        ws_driver ? ws_driver->sequence.last : 0, telemetry->drops, telemetry->gaps);
+    len += snprintf(buffer + len, size - len,
+        "\"link\":{\"rate\":\"%u\",\"p50_ms\":\"%u\",\"p99_ms\":\"%u\",\"max_gap_ms\":\"%u\",\"failsafes\":\"%u\",",
+        telemetry->link_rate, telemetry->link_p50_ms, telemetry->link_p99_ms, telemetry->link_max_gap_ms, telemetry->link_failsafes);
+    if (telemetry->link_ap_rssi)
+    {
+      len += snprintf(buffer + len, size - len, "\"ap_rssi\":\"%d\",", telemetry->link_ap_rssi);
+    }
+    len += snprintf(buffer + len, size - len, "\"station_rssi\":[");
+    for (int index = 0; index < telemetry->link_station_count; ++index)
+    {
+      len += snprintf(buffer + len, size - len, "%s\"%d\"", index ? "," : "", telemetry->link_station_rssi[index]);
+    }
+    len += snprintf(buffer + len, size - len, "]},");
+  }
+  len += snprintf(buffer + len, size - len, "\"status\":\"%s\"}", telemetry->failsafe ? "failsafe" : "ok");
+  return len;
+}
+
+/* A telemetry message encoded once and shared by every session with the same topics */
+typedef struct
+{
+  uint8_t topics;
+  ws_telemetry_t telemetry;
+  size_t len;
+  char buffer[512];
+}
+ws_telemetry_frame_t;
+
+/* Push telemetry to subscribed sessions when a value changes or the period elapses, runs on the httpd task */
+static void ws_push_telemetry(void* arg)
+{
+  static ws_telemetry_frame_t frames[WS_MAX_SESSIONS];
+  int encoded = 0;
+
+  const TickType_t now = xTaskGetTickCount();
+  for (int i = 0; i < WS_MAX_SESSIONS; ++i)
+  {
+    ws_session_t* session = ws_sessions[i];
+    if (session && session->topics)
+    {
+      // Reuse the message if another session already needed the same topics
+      ws_telemetry_frame_t* frame = NULL;
+      for (int j = 0; j < encoded; ++j)
+      {
+        if (frames[j].topics == session->topics)
+        {
+          frame = &frames[j];
+          break;
+        }
+      }
+      if (!frame)
+      {
+        frame = &frames[encoded++];
+        frame->topics = session->topics;
+        ws_read_telemetry(frame->topics, &frame->telemetry);
+        frame->len = ws_format_telemetry(frame->buffer, sizeof(frame->buffer), frame->topics, &frame->telemetry);
+      }
+
+      if (memcmp(&frame->telemetry, &session->telemetry, sizeof(frame->telemetry)) != 0 || now - session->last_telemetry >= session->telemetry_period)
+      {
+        httpd_ws_frame_t telemetry_pkt = {
+          .final = false,
+          .fragmented = false,
+          .type = HTTPD_WS_TYPE_TEXT,
+          .payload = (unsigned char*)frame->buffer,
+          .len = frame->len
+        };
+        esp_err_t ret = httpd_ws_send_frame_async(session->handle, session->fd, &telemetry_pkt);
+        if (ret != ESP_OK) {
+          ESP_LOGE(TAG, "httpd_ws_send_frame_async failed with %d", ret);
+        }
+        session->telemetry = frame->telemetry;
+        session->last_telemetry = now;
+      }
+    }
+  }
+}
+
+void server_notify_telemetry(void)
+{
+  if (ws_server && ws_telemetry_sessions > 0)
+  {
+    httpd_queue_work(ws_server, ws_push_telemetry, NULL);
+  }
+}
+
+static void ws_push_timer_callback(xTimerHandle xTimer)
+{
+  if (ws_server && ws_streaming_sessions > 0)
+  {
+    httpd_queue_work(ws_server, ws_push_status, NULL);
+  }
+}
+
+void server_notify_status(void)
+{
+  if (ws_server && ws_streaming_sessions > 0)
+  {
+    httpd_queue_work(ws_server, ws_push_status, NULL);
+  }
+}
+
 static esp_err_t ws_handler(httpd_req_t *req)
 {
   //static int packet_count = 0;
@@ -218,6 +1360,7 @@ static esp_err_t ws_handler(httpd_req_t *req)
     ESP_LOGI(TAG, "Handshake done, the new connection was opened");
     return ESP_OK;
   }
+  ws_frame_received = latency_now();
   httpd_ws_frame_t ws_pkt;
   uint8_t *buf = NULL;
   memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
@@ -229,56 +1372,157 @@ static esp_err_t ws_handler(httpd_req_t *req)
     return ret;
   }
   //ESP_LOGI(TAG, "frame len is %d", ws_pkt.len);
+  const bool binary = (ws_pkt.type == HTTPD_WS_TYPE_BINARY);
+  ws_session_t* session = ws_session_get(req);
   if (ws_pkt.len) {
-    /* ws_pkt.len + 1 is for NULL termination as we are expecting a string */
-    buf = calloc(1, ws_pkt.len + 1);
-    if (buf == NULL) {
-      ESP_LOGE(TAG, "Failed to calloc memory for buf");
-      return ESP_ERR_NO_MEM;
+    if (session && ws_pkt.len <= WS_RX_BUFSIZE) {
+      /* Receive into the session buffer, avoiding the heap for ordinary frames */
+      ws_pkt.payload = session->rx_buf;
+    }
+    else {
+      /* ws_pkt.len + 1 is for NULL termination as we are expecting a string */
+      buf = ws_malloc(ws_pkt.len + 1);
+      if (buf == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for buf");
+        return ESP_ERR_NO_MEM;
+      }
+      ws_pkt.payload = buf;
     }
-    ws_pkt.payload = buf;
     /* Set max_len = ws_pkt.len to get the frame payload */
     ret = httpd_ws_recv_frame(req, &ws_pkt, ws_pkt.len);
     if (ret != ESP_OK) {
       ESP_LOGE(TAG, "httpd_ws_recv_frame failed with %d", ret);
-      free(buf);
+      if (buf) {
+        ws_free(buf);
+      }
       return ret;
     }
+    ws_pkt.payload[ws_pkt.len] = '\0';
     //ESP_LOGI(TAG, "Packet %d Message: %s", ++packet_count, ws_pkt.payload);
   }
 
-  // Build response
-  cJSON* response = cJSON_CreateObject();
+#ifdef CONFIG_MLINK_PROFILE_DECODE
+  const uint32_t decode_start = soc_get_ccount();
+#endif
 
-  // Process packet
-  cJSON* root = cJSON_Parse((char*)ws_pkt.payload);
-  if (root)
+  // Try the allocation free paths first
+  bool handled = false;
+  bool decoded = false;
+  servo_frame_t frame = { 0 };
+  if (binary)
   {
-    process_ws_payload(root, response);
-    cJSON_Delete(root);
+    decoded = protocol_decode_binary(ws_pkt.payload, ws_pkt.len, &frame);
+    if (decoded && ws_frame_accept(session, &frame))
+    {
+      frame.received = ws_frame_received;
+      frame.decoded = latency_now();
+      protocol_apply(&frame);
+    }
+    handled = true;
+#ifdef CONFIG_MLINK_PROFILE_DECODE
+    decode_profile_add(&decode_profile_binary, soc_get_ccount() - decode_start);
+#endif
   }
+  else if (ws_pkt.payload && protocol_decode_servos_json((const char*)ws_pkt.payload, ws_pkt.len, &frame))
+  {
+    decoded = true;
+    if (ws_frame_accept(session, &frame))
+    {
+      frame.received = ws_frame_received;
+      frame.decoded = latency_now();
+      protocol_apply(&frame);
+    }
+    handled = true;
+#ifdef CONFIG_MLINK_PROFILE_DECODE
+    decode_profile_add(&decode_profile_json, soc_get_ccount() - decode_start);
+#endif
+  }
+
+  // Streaming sessions don't get a reply to servo frames
+  if (handled && session && session->streaming)
+  {
+    ++ws_fast_frames;
+    if (buf) {
+      ws_free(buf);
+    }
+    return ESP_OK;
+  }
+
+  // Only the httpd task runs this handler, so the response buffer can stay off its stack
+  static char response_buffer[1024];
+  char* response_text = response_buffer;
+  char* response_heap = NULL;
+  if (handled)
+  {
+    // Servo frames only need the failsafe status, and a frame that didn't decode has no request ID to echo
+    ws_format_status(response_buffer, sizeof(response_buffer), session, NULL, decoded ? &frame : NULL);
+    ++ws_fast_frames;
+  }
+  else
+  {
+    // Build response
+    cJSON* response = cJSON_CreateObject();
+
+    // Process packet
+    if (ws_pkt.payload)
+    {
+      cJSON* root = cJSON_Parse((char*)ws_pkt.payload);
+      if (root)
+      {
+        process_ws_payload(root, response, session);
+        cJSON_Delete(root);
+      }
+#ifdef CONFIG_MLINK_PROFILE_DECODE
+      decode_profile_add(&decode_profile_json, soc_get_ccount() - decode_start);
+#endif
+    }
 
-  // Failsafe status
-  cJSON* status = cJSON_CreateString(query_failsafe_engaged() ? "failsafe" : "ok");
-  cJSON_AddItemToObject(response, "status", status);
+    // Failsafe status
+    cJSON* status = cJSON_CreateString(query_failsafe_engaged() ? "failsafe" : "ok");
+    cJSON_AddItemToObject(response, "status", status);
+    if (session && session->sequence.valid)
+    {
+      add_unsigned_string(response, "seq", session->sequence.last);
+    }
+
+    // Replies too big for the static buffer go out from the heap, or as an explicit error rather than a stale reply
+    if (!cJSON_PrintPreallocated(response, response_buffer, sizeof(response_buffer), false))
+    {
+      response_heap = cJSON_PrintUnformatted(response);
+      if (response_heap)
+      {
+        response_text = response_heap;
+      }
+      else
+      {
+        ESP_LOGW(TAG, "WS response too large");
+        snprintf(response_buffer, sizeof(response_buffer), "{\"status\":\"%s\",\"error\":\"response too large\"}",
+            query_failsafe_engaged() ? "failsafe" : "ok");
+      }
+    }
+    cJSON_Delete(response);
+    ++ws_slow_frames;
+  }
+  //ESP_LOGI(TAG, "WS Response: %s", response_text);
 
-  char response_buffer[256];
-  cJSON_PrintPreallocated(response, response_buffer, sizeof(response_buffer), false);
-  //ESP_LOGI(TAG, "WS Response: %s", response_buffer);
-  cJSON_Delete(response);
   httpd_ws_frame_t response_pkt = {
     .final = false,
     .fragmented = false,
     .type = HTTPD_WS_TYPE_TEXT,
-    .payload = (unsigned char*)response_buffer,
-    .len = strlen((char*)response_buffer)
+    .payload = (unsigned char*)response_text,
+    .len = strlen(response_text)
   };
 
   ret = httpd_ws_send_frame(req, &response_pkt);
   if (ret != ESP_OK) {
     ESP_LOGE(TAG, "httpd_ws_send_frame failed with %d", ret);
   }
-  free(buf);
+  if (response_heap) {
+    cJSON_free(response_heap);
+  }
+  if (buf) {
+    ws_free(buf);
+  }
   return ret;
 }
 
@@ -850,6 +2094,13 @@ static httpd_handle_t start_webserver(void)
   * target URIs which match the wildcard scheme */
  config.uri_match_fn = httpd_uri_match_wildcard;
 
+  // Route cJSON through the counting allocator
+  cJSON_Hooks hooks = {
+    .malloc_fn = ws_malloc,
+    .free_fn = ws_free,
+  };
+  cJSON_InitHooks(&hooks);
+
   // Start the httpd server
   ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
   if (httpd_start(&server, &config) == ESP_OK) {
@@ -859,6 +2110,7 @@ static httpd_handle_t start_webserver(void)
     httpd_register_uri_handler(server, &file_upload);
     httpd_register_uri_handler(server, &file_delete);
     httpd_register_uri_handler(server, &file_download);
+    ws_server = server;
     return server;
   }
 
@@ -866,48 +2118,18 @@ static httpd_handle_t start_webserver(void)
   return NULL;
 }
 
-static esp_err_t stop_webserver(httpd_handle_t server)
-{
-  // Stop the httpd server
-  return httpd_stop(server);
-}
-
-static void disconnect_handler(void* arg, esp_event_base_t event_base,
-                 int32_t event_id, void* event_data)
-{
-  httpd_handle_t* server = (httpd_handle_t*) arg;
-  if (*server) {
-    ESP_LOGI(TAG, "Stopping webserver");
-    if (stop_webserver(*server) == ESP_OK) {
-      *server = NULL;
-    } else {
-      ESP_LOGE(TAG, "Failed to stop http server");
-    }
-  }
-}
-
-static void connect_handler(void* arg, esp_event_base_t event_base,
-              int32_t event_id, void* event_data)
-{
-  httpd_handle_t* server = (httpd_handle_t*) arg;
-  if (*server == NULL) {
-    ESP_LOGI(TAG, "Starting webserver");
-    *server = start_webserver();
-  }
-}
-
 void server_init(void)
 {
-  static httpd_handle_t server = NULL;
-
   const char* const base_path = "/data";
   ESP_ERROR_CHECK(mount_storage(base_path));
   strncpy(server_data.base_path, base_path, ESP_VFS_PATH_MAX + 1);
 
-  ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &connect_handler, &server));
-  ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &disconnect_handler, &server));
+  /* The server listens on every interface, so it runs for good and the STA coming and going never stops it, the AP
+   * and anyone driving through it carry on regardless */
+  start_webserver();
 
-  /* Start the server for the first time */
-  server = start_webserver();
+  /* Periodically push status to streaming sessions */
+  xTimerHandle push_timer = xTimerCreate("ws-push-timer", pdMS_TO_TICKS(WS_PUSH_INTERVAL_MS), pdTRUE, NULL, ws_push_timer_callback);
+  xTimerStart(push_timer, 0);
 }
 
@@ -1,3 +1,9 @@
 #pragma once
 
 void server_init(void);
+
+// Push status to streaming WebSocket sessions after a failsafe change
+void server_notify_status(void);
+
+// Push telemetry to subscribed WebSocket sessions whose values changed or whose period elapsed
+void server_notify_telemetry(void);
@@ -3,18 +3,24 @@
 #include <stdlib.h>
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_err.h"
 
+#include "esp8266/eagle_soc.h"
 #include "esp8266/gpio_register.h"
 #include "esp8266/pin_mux_register.h"
+#include "esp8266/timer_struct.h"
 
 #include "driver/gpio.h"
-#include "driver/pwm.h"
+#include "driver/hw_timer.h"
+#include "driver/soc.h"
 
+#include "latency.h"
 #include "servo.h"
+#include "servo_edges.h"
 
 #define PWM_IO_COUNT      6
 
@@ -27,8 +33,25 @@
 #define PWM_4_OUT_IO_NUM  14  // Servo 5
 #define PWM_5_OUT_IO_NUM  13  // Servo 6
 
-// PWM period 20ms (50hz)
-#define PWM_PERIOD    (20000)
+#ifndef CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ
+#define CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ 80
+#endif
+
+// Edges are timed on the free-running CPU cycle counter, FRC1 only wakes the interrupt
+#define PWM_CYCLES_PER_US       CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ
+
+// FRC1 runs from the APB clock divided by 16
+#define PWM_TIMER_TICKS_PER_US  (APB_CLK_FREQ / 16 / 1000000)
+
+// Starting guess and ceiling for how late the timer interrupt runs, the engine measures the real figure as it goes
+#define PWM_ISR_LATENCY_US      2
+#define PWM_ISR_LATENCY_MAX_US  10
+
+// Time to leave the interrupt and arm the timer, edges any closer than that are waited for in the interrupt instead
+#define PWM_ISR_EXIT_US         2
+
+// How often to look for work when every group is idle
+#define PWM_IDLE_US             1000
 
 static const char *TAG = "m-link-servo";
 
@@ -42,29 +65,211 @@ static const uint32_t pin_num[PWM_IO_COUNT] = {
   PWM_5_OUT_IO_NUM,
 };
 
-// duties table, real_duty = duties[x]/PERIOD
-static uint32_t duties[PWM_IO_COUNT] = {
+typedef struct
+{
+  const char* name;
+  uint32_t period_us;
+  uint32_t min_us;
+  uint32_t max_us;
+}
+servo_mode_info_t;
+
+// Period and output pulse range for each mode, SERVO_INPUT_MIN..SERVO_INPUT_MAX is scaled onto min_us..max_us
+static const servo_mode_info_t mode_info[SERVO_MODE_COUNT] = {
+  [SERVO_MODE_50HZ]       = { "50hz",       20000, 1000, 2000 },
+  [SERVO_MODE_333HZ]      = { "333hz",       3000, 1000, 2000 },
+  [SERVO_MODE_ONESHOT125] = { "oneshot125",  1000,  125,  250 },
+  [SERVO_MODE_ONESHOT42]  = { "oneshot42",    500,   42,   84 },
+};
+
+static servo_mode_t modes[PWM_IO_COUNT] = {
+  SERVO_MODE_50HZ, SERVO_MODE_50HZ, SERVO_MODE_50HZ, SERVO_MODE_50HZ, SERVO_MODE_50HZ, SERVO_MODE_50HZ,
+};
+
+// last requested pulse widths, kept so a mode change can rescale them
+static int inputs[PWM_IO_COUNT] = {
   1500, 1500, 1500, 1500, 1500, 1500,
 };
 
-// phase table, delay = (phase[x]/360)*PERIOD
-static float phase[PWM_IO_COUNT] = {
-  0.f, 0.f, 0.f, 0.f, 0.f, 0.f,
+// duties table in CPU cycles
+static uint32_t duties[PWM_IO_COUNT] = {
+  1500 * PWM_CYCLES_PER_US, 1500 * PWM_CYCLES_PER_US, 1500 * PWM_CYCLES_PER_US,
+  1500 * PWM_CYCLES_PER_US, 1500 * PWM_CYCLES_PER_US, 1500 * PWM_CYCLES_PER_US,
 };
 
-void servo_init(void)
+// set when duties differ from what the PWM engine was last given
+static bool duties_changed = false;
+
+/*
+ * PWM engine
+ *
+ * Each mode is a group of channels with a precomputed edge table, see servo_edges.h. Edges are scheduled against the
+ * CPU cycle counter from their nominal times, so interrupt latency never adds up from one edge to the next. FRC1 is
+ * only used to wake the interrupt, early by the latency it has been measured to have, and the interrupt then waits for
+ * the exact cycle of the edge. Edges closer than the interrupt can get out and back in are waited for in the same
+ * interrupt, so no edge is ever played early.
+ */
+static uint32_t pwm_masks[PWM_IO_COUNT];
+static servo_group_t pwm_groups[SERVO_MODE_COUNT];
+
+// Channels kept out of every table while they move between groups
+static uint32_t pwm_parked = 0;
+
+/* When the timer was asked to fire, and how late it usually does, in cycles */
+static uint32_t pwm_wake = 0;
+static uint32_t pwm_latency = PWM_ISR_LATENCY_US * PWM_CYCLES_PER_US;
+
+static void IRAM_ATTR servo_timer_isr(void* arg)
 {
-  ESP_ERROR_CHECK( pwm_init(PWM_PERIOD, duties, PWM_IO_COUNT, pin_num) );
-  ESP_ERROR_CHECK( pwm_set_phases(phase) );
-  ESP_ERROR_CHECK( pwm_start() );
+  uint32_t now = soc_get_ccount();
 
+  // Jump up to the worst latency seen, within reason, and ease back down when it improves
+  const int32_t late = (int32_t)(now - pwm_wake);
+  if (late > (int32_t)pwm_latency)
+  {
+    pwm_latency = late < PWM_ISR_LATENCY_MAX_US * PWM_CYCLES_PER_US ? late : PWM_ISR_LATENCY_MAX_US * PWM_CYCLES_PER_US;
+  }
+  else if (late > 0)
+  {
+    pwm_latency -= (pwm_latency - late) >> 4;
+  }
+
+  uint32_t next;
+  for (;;)
+  {
+    uint32_t at;
+    if (!servo_groups_next(pwm_groups, SERVO_MODE_COUNT, now, &at))
+    {
+      next = now + PWM_IDLE_US * PWM_CYCLES_PER_US;
+      break;
+    }
+
+    // Leave it to the timer if there is time to get out and back in
+    now = soc_get_ccount();
+    if ((int32_t)(at - now) > (int32_t)(pwm_latency + PWM_ISR_EXIT_US * PWM_CYCLES_PER_US))
+    {
+      next = at;
+      break;
+    }
+
+    uint32_t set_mask = 0;
+    uint32_t clear_mask = 0;
+    servo_groups_play(pwm_groups, SERVO_MODE_COUNT, at, &set_mask, &clear_mask);
+
+    // Wait for the edge rather than play it early, a late edge is played straight away
+    while ((int32_t)(at - soc_get_ccount()) > 0)
+    {
+    }
+    GPIO_REG_WRITE(GPIO_OUT_W1TC_ADDRESS, clear_mask);
+    GPIO_REG_WRITE(GPIO_OUT_W1TS_ADDRESS, set_mask);
+    now = soc_get_ccount();
+  }
+
+  pwm_wake = next - pwm_latency;
+  const int32_t wait = (int32_t)(pwm_wake - soc_get_ccount());
+  frc1.load.data = wait > 0 ? (uint32_t)wait * PWM_TIMER_TICKS_PER_US / PWM_CYCLES_PER_US + 1 : 1;
+}
+
+// Convert an input pulse width to cycles in a channel's mode, clamping to the mode's range
+static uint32_t servo_scale(servo_mode_t mode, int pulsewidth_ms)
+{
+  if (pulsewidth_ms < SERVO_INPUT_MIN)
+  {
+    pulsewidth_ms = SERVO_INPUT_MIN;
+  }
+  else if (pulsewidth_ms > SERVO_INPUT_MAX)
+  {
+    pulsewidth_ms = SERVO_INPUT_MAX;
+  }
+  const servo_mode_info_t* info = &mode_info[mode];
+  return (info->min_us * PWM_CYCLES_PER_US) +
+      ((pulsewidth_ms - SERVO_INPUT_MIN) * (info->max_us - info->min_us) * PWM_CYCLES_PER_US) / (SERVO_INPUT_MAX - SERVO_INPUT_MIN);
+}
+
+// Fill each group's back table from the duties and hand it over for the group's next period, with the scheduler
+// suspended so only one task fills the back tables at a time
+static void servo_build_tables(void)
+{
+  for (int mode = 0; mode < SERVO_MODE_COUNT; ++mode)
+  {
+    servo_group_t* group = &pwm_groups[mode];
+    uint32_t selected = 0;
+    for (int channel = 0; channel < PWM_IO_COUNT; ++channel)
+    {
+      if (modes[channel] == mode && !(pwm_parked & (1u << channel)))
+      {
+        selected |= 1u << channel;
+      }
+    }
+
+    // Groups with nothing to drive before or after stay idle
+    if (!selected && group->edges[group->active].set_mask == 0)
+    {
+      group->pending = false;
+      continue;
+    }
+
+    // Stop the interrupt swapping tables while the back one is rewritten, the back one is only read after clearing it
+    group->pending = false;
+    __sync_synchronize();
+    servo_edges_build(&group->edges[group->active ^ 1], pwm_masks, duties, PWM_IO_COUNT, selected);
+    __sync_synchronize();
+    group->pending = true;
+  }
+}
+
+// Wait for every group to pick up its pending table, which takes at most one of the longest periods
+static void servo_wait_tables(void)
+{
+  for (int attempt = 0; attempt < 10; ++attempt)
+  {
+    bool pending = false;
+    for (int mode = 0; mode < SERVO_MODE_COUNT; ++mode)
+    {
+      pending |= pwm_groups[mode].pending;
+    }
+    if (!pending)
+    {
+      return;
+    }
+    vTaskDelay(1);
+  }
+  ESP_LOGW(TAG, "PWM tables still pending.");
+}
+
+void servo_init(void)
+{
   gpio_config_t config;
-  config.pin_bit_mask = (1ull<<(ENABLE_IO_NUM));
+  config.pin_bit_mask = 0;
+  for (int channel = 0; channel < PWM_IO_COUNT; ++channel)
+  {
+    config.pin_bit_mask |= (1ull<<(pin_num[channel]));
+    pwm_masks[channel] = 1u << pin_num[channel];
+  }
   config.mode = GPIO_MODE_OUTPUT;
   config.pull_up_en = GPIO_PULLUP_DISABLE;
   config.pull_down_en = GPIO_PULLDOWN_DISABLE;
   config.intr_type = GPIO_INTR_DISABLE;
   ESP_ERROR_CHECK( gpio_config(&config) );
+
+  // Every group starts its first period together, shortly after the timer first fires
+  const uint32_t first = soc_get_ccount() + 100 * PWM_CYCLES_PER_US;
+  for (int mode = 0; mode < SERVO_MODE_COUNT; ++mode)
+  {
+    servo_group_init(&pwm_groups[mode], mode_info[mode].period_us * PWM_CYCLES_PER_US, first);
+  }
+  servo_build_tables();
+
+  ESP_ERROR_CHECK( hw_timer_init(servo_timer_isr, NULL) );
+  ESP_ERROR_CHECK( hw_timer_set_clkdiv(TIMER_CLKDIV_16) );
+  ESP_ERROR_CHECK( hw_timer_set_intr_type(TIMER_EDGE_INT) );
+  ESP_ERROR_CHECK( hw_timer_set_reload(false) );
+  ESP_ERROR_CHECK( hw_timer_set_load_data(PWM_TIMER_TICKS_PER_US) );
+  pwm_wake = soc_get_ccount() + PWM_CYCLES_PER_US;
+  ESP_ERROR_CHECK( hw_timer_enable(true) );
+
+  config.pin_bit_mask = (1ull<<(ENABLE_IO_NUM));
+  ESP_ERROR_CHECK( gpio_config(&config) );
   ESP_ERROR_CHECK( gpio_set_level(ENABLE_IO_NUM, 1) );
 }
 
@@ -80,24 +285,105 @@ void servo_disable(void)
 
 void servo_set(int channel, int pulsewidth_ms)
 {
-  if (pulsewidth_ms <= 1000)
-  {
-    duties[channel] = 1000;
-  }
-  else if (pulsewidth_ms >= 2000)
+  inputs[channel] = pulsewidth_ms;
+  const uint32_t duty = servo_scale(modes[channel], pulsewidth_ms);
+  if (duty != duties[channel])
   {
-    duties[channel] = 2000;
+    duties[channel] = duty;
+    duties_changed = true;
   }
-  else
+}
+
+void servo_refresh(void)
+{
+  latency_frame_output();
+
+  // Nothing to do if the tables being played are already up to date
+  if (!duties_changed)
   {
-    duties[channel] = pulsewidth_ms;
+    return;
   }
+
+  // A six entry sort per group, the interrupt picks the tables up at each group's next period boundary
+  vTaskSuspendAll();
+  duties_changed = false;
+  servo_build_tables();
+  xTaskResumeAll();
 }
 
-void servo_refresh(void)
+bool servo_set_modes(const char* names)
 {
-  pwm_set_duties(duties);
-  pwm_start();
+  // Parse every name before changing anything
+  servo_mode_t parsed[PWM_IO_COUNT];
+  int count = 0;
+  const char* name = names;
+  while (count < PWM_IO_COUNT && *name)
+  {
+    const size_t len = strcspn(name, ",");
+    servo_mode_t mode = SERVO_MODE_COUNT;
+    for (int i = 0; i < SERVO_MODE_COUNT; ++i)
+    {
+      if (strlen(mode_info[i].name) == len && strncmp(mode_info[i].name, name, len) == 0)
+      {
+        mode = i;
+      }
+    }
+    if (mode == SERVO_MODE_COUNT)
+    {
+      ESP_LOGW(TAG, "Unknown PWM mode in '%s'.", names);
+      return false;
+    }
+    parsed[count++] = mode;
+    name += len;
+    if (*name == ',')
+    {
+      ++name;
+    }
+  }
+  if (count == 0)
+  {
+    return false;
+  }
+
+  // Channels without a mode of their own repeat the last one
+  for (int channel = count; channel < PWM_IO_COUNT; ++channel)
+  {
+    parsed[channel] = parsed[count - 1];
+  }
+
+  ESP_LOGI(TAG, "PWM modes set to '%s'.", names);
+
+  uint32_t moving = 0;
+  for (int channel = 0; channel < PWM_IO_COUNT; ++channel)
+  {
+    if (parsed[channel] != modes[channel])
+    {
+      moving |= 1u << channel;
+    }
+  }
+  if (!moving)
+  {
+    return true;
+  }
+
+  // Take the channels out of their old group and let its last pulse finish, so no pulse mixes the two periods
+  vTaskSuspendAll();
+  pwm_parked = moving;
+  servo_build_tables();
+  xTaskResumeAll();
+  servo_wait_tables();
+
+  // Then rescale the pulse widths to the new ranges and start the channels in their new groups
+  vTaskSuspendAll();
+  for (int channel = 0; channel < PWM_IO_COUNT; ++channel)
+  {
+    modes[channel] = parsed[channel];
+    duties[channel] = servo_scale(modes[channel], inputs[channel]);
+  }
+  pwm_parked = 0;
+  servo_build_tables();
+  xTaskResumeAll();
+  return true;
 }
 
 void servo_set_all(int s1, int s2, int s3, int s4, int s5, int s6)
@@ -1,5 +1,22 @@
 #pragma once
 
+#include <stdbool.h>
+
+// Output modes, each with its own period and pulse width range
+typedef enum
+{
+  SERVO_MODE_50HZ,        // Standard servos, 1000-2000 us at 50 Hz
+  SERVO_MODE_333HZ,       // Digital servos, 1000-2000 us at 333 Hz
+  SERVO_MODE_ONESHOT125,  // ESCs, 125-250 us at 1 kHz
+  SERVO_MODE_ONESHOT42,   // ESCs, 42-84 us at 2 kHz
+  SERVO_MODE_COUNT,
+}
+servo_mode_t;
+
+// Input pulse width range in us, mapped onto each mode's own range
+#define SERVO_INPUT_MIN  1000
+#define SERVO_INPUT_MAX  2000
+
 /// Initialise the PWM/servo control module
 void servo_init(void);
 
@@ -7,11 +24,15 @@ void servo_init(void);
 void servo_enable(void);
 void servo_disable(void);
 
-// Set desired servo pulse width in ms
+// Set desired servo pulse width in ms, from 1000 to 2000 whatever the channel's mode
 void servo_set(int channel, int pulsewidth_ms);
 
-// Push desired pulse widths to the servos
+// Push desired pulse widths to the servos, if any of them changed
 void servo_refresh(void);
 
+// Set the mode of each channel from a comma separated list of "50hz", "333hz", "oneshot125" or "oneshot42"
+// Channels past the end of the list take the last mode, returns false without changing anything if a name is unknown
+bool servo_set_modes(const char* names);
+
 // Update all servos and refresh
 void servo_set_all(int s1, int s2, int s3, int s4, int s5, int s6);
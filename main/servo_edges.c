@@ -0,0 +1,47 @@
+#include <string.h>
+
+#include "servo_edges.h"
+
+void servo_edges_build(servo_edges_t* edges, const uint32_t* masks, const uint32_t* duties, int count, uint32_t selected)
+{
+  edges->set_mask = 0;
+  edges->count = 0;
+  for (int channel = 0; channel < count; ++channel)
+  {
+    if (!(selected & (1u << channel)))
+    {
+      continue;
+    }
+    const uint32_t mask = masks[channel];
+    const uint32_t duty = duties[channel];
+    edges->set_mask |= mask;
+
+    // Insertion sort, there are only a handful of channels
+    int index = edges->count;
+    while (index > 0 && edges->time[index - 1] > duty)
+    {
+      --index;
+    }
+
+    // Edges at exactly the same time share an entry, anything else gets its own so it is never played early
+    if (index > 0 && edges->time[index - 1] == duty)
+    {
+      edges->clear_mask[index - 1] |= mask;
+    }
+    else
+    {
+      memmove(&edges->time[index + 1], &edges->time[index], (edges->count - index) * sizeof(edges->time[0]));
+      memmove(&edges->clear_mask[index + 1], &edges->clear_mask[index], (edges->count - index) * sizeof(edges->clear_mask[0]));
+      edges->time[index] = duty;
+      edges->clear_mask[index] = mask;
+      ++edges->count;
+    }
+  }
+}
+
+void servo_group_init(servo_group_t* group, uint32_t period, uint32_t first)
+{
+  memset(group, 0, sizeof(*group));
+  group->period = period;
+  group->start = first - period;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * PWM edge tables and the schedule the timer interrupt plays them on
+ *
+ * Channels sharing a mode form a group with its own period. Each group plays a sorted edge table: every pin in
+ * set_mask goes high at the start of the period, then the pins in clear_mask[n] go low time[n] cycles into it.
+ * Tables are double-buffered, servo_refresh fills the back one and marks it pending, and a group only swaps it in at
+ * its own period boundary so a pulse in flight is never cut short or stretched.
+ *
+ * Nothing here touches the hardware, so the tables and the schedule can be tested on the host.
+ */
+#define SERVO_EDGES_MAX 6
+
+// Inlined into the timer interrupt, which runs from IRAM
+#define SERVO_EDGES_INLINE static inline __attribute__((always_inline))
+
+typedef struct
+{
+  uint32_t set_mask;
+  int count;
+  uint32_t time[SERVO_EDGES_MAX];
+  uint32_t clear_mask[SERVO_EDGES_MAX];
+}
+servo_edges_t;
+
+typedef struct
+{
+  uint32_t period;
+  servo_edges_t edges[2];
+  volatile int active;
+  volatile bool pending;
+  uint32_t start;         // When the current period started
+  int edge;               // Next edge of the active table, count means the period boundary is next
+}
+servo_group_t;
+
+// Build an edge table from the selected channels, pulse widths in cycles, merging only edges at the same time
+void servo_edges_build(servo_edges_t* edges, const uint32_t* masks, const uint32_t* duties, int count, uint32_t selected);
+
+// Start a group with an empty table, its first period boundary is at the given time
+void servo_group_init(servo_group_t* group, uint32_t period, uint32_t first);
+
+// Whether a group has nothing to drive, idle groups take no interrupts at all
+SERVO_EDGES_INLINE bool servo_group_idle(const servo_group_t* group)
+{
+  return group->edges[group->active].set_mask == 0 && !group->pending;
+}
+
+// Time of a group's next edge
+SERVO_EDGES_INLINE uint32_t servo_group_next(const servo_group_t* group)
+{
+  const servo_edges_t* edges = &group->edges[group->active];
+  return group->start + (group->edge < edges->count ? edges->time[group->edge] : group->period);
+}
+
+// Play a group's next edge, adding the pins it changes to the masks
+SERVO_EDGES_INLINE void servo_group_play(servo_group_t* group, uint32_t* set_mask, uint32_t* clear_mask)
+{
+  const servo_edges_t* edges = &group->edges[group->active];
+  if (group->edge < edges->count)
+  {
+    *clear_mask |= edges->clear_mask[group->edge++];
+    return;
+  }
+
+  // Period boundary, the only place a new table is picked up
+  group->start += group->period;
+  if (group->pending)
+  {
+    group->active ^= 1;
+    group->pending = false;
+    edges = &group->edges[group->active];
+  }
+  *set_mask |= edges->set_mask;
+  group->edge = 0;
+}
+
+/*
+ * Find the earliest edge due across every group, returns false if they are all idle
+ *
+ * A group that was idle starts its first period now rather than catching up on the periods it skipped.
+ */
+SERVO_EDGES_INLINE bool servo_groups_next(servo_group_t* groups, int count, uint32_t now, uint32_t* at)
+{
+  bool any = false;
+  for (int index = 0; index < count; ++index)
+  {
+    servo_group_t* group = &groups[index];
+    if (servo_group_idle(group))
+    {
+      continue;
+    }
+    if (group->edges[group->active].set_mask == 0 && (int32_t)(group->start + group->period - now) < 0)
+    {
+      group->start = now - group->period;
+    }
+    const uint32_t next = servo_group_next(group);
+    if (!any || (int32_t)(next - *at) < 0)
+    {
+      *at = next;
+      any = true;
+    }
+  }
+  return any;
+}
+
+// Play every edge due at the given time, so edges that coincide across groups change together
+SERVO_EDGES_INLINE void servo_groups_play(servo_group_t* groups, int count, uint32_t at, uint32_t* set_mask, uint32_t* clear_mask)
+{
+  for (int index = 0; index < count; ++index)
+  {
+    servo_group_t* group = &groups[index];
+    if (!servo_group_idle(group) && servo_group_next(group) == at)
+    {
+      servo_group_play(group, set_mask, clear_mask);
+    }
+  }
+}
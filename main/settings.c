@@ -1,170 +1,370 @@
 #include "settings.h"
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
 
 #include "hostname.h"
 
-static char name[32];
-static char ap_ssid[64];
-static char ap_password[64];
-static char ssid[64];
-static char password[64];
+static const char* TAG = "m-link-settings";
+
+// Bump when the layout of settings_store_t changes, older blobs are then ignored
+#define SETTINGS_VERSION 2
+
+/*
+ * Every setting, saved to NVS as one blob and read back with one call
+ *
+ * Setters only change the copy in RAM and mark it dirty, settings_commit writes it out later so a flash erase never
+ * stalls the task handling a request. The CRC covers everything before it.
+ */
+typedef struct
+{
+  uint16_t version;
+  char name[32];
+  char ap_ssid[64];
+  char ap_password[64];
+  char ssid[64];
+  char password[64];
+  char pwm_modes[64];
+  uint16_t failsafe_timeout;
+  uint16_t failsafe_ramp;
+  int16_t failsafes[SETTINGS_FAILSAFES];
+  uint32_t crc;
+}
+settings_store_t;
+
+static settings_store_t settings;
+static volatile bool settings_dirty = false;
+
+// Held for the whole of a commit, so a commit before a reboot waits for one in progress instead of seeing the settings
+// clean and restarting part way through the write
+static SemaphoreHandle_t settings_commit_lock = NULL;
+
+// Keys used before settings were stored as one blob, read once to migrate and then erased
+static const char* const settings_legacy_keys[] = {
+  "bot_name",
+  "bot_ap_ssid",
+  "bot_ap_password",
+  "bot_ssid",
+  "bot_password",
+  "bot_pwm_modes",
+  "bot_fs_timeout",
+  "bot_fs_ramp",
+};
+static bool settings_legacy = false;
+
+static uint32_t settings_crc32(const void* data, size_t length)
+{
+  const uint8_t* bytes = data;
+  uint32_t crc = 0xffffffff;
+  for (size_t index = 0; index < length; ++index)
+  {
+    crc ^= bytes[index];
+    for (int bit = 0; bit < 8; ++bit)
+    {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+// Copy a string setting, marking the settings dirty if it changed
+static void settings_set_string(char* setting, size_t size, const char* value)
+{
+  if (strncmp(setting, value, size - 1) != 0)
+  {
+    strncpy(setting, value, size - 1);
+    setting[size - 1] = 0;
+    settings_dirty = true;
+  }
+}
 
 const char* settings_get_name(void)
 {
-  return name;
+  return settings.name;
 }
 
 const char* settings_get_ap_ssid(void)
 {
-  return ap_ssid;
+  return settings.ap_ssid;
 }
 
 const char* settings_get_ap_password(void)
 {
-  return ap_password;
+  return settings.ap_password;
 }
 
 const char* settings_get_ssid(void)
 {
-  return ssid;
+  return settings.ssid;
 }
 
 const char* settings_get_password(void)
 {
-  return password;
+  return settings.password;
+}
+
+const char* settings_get_pwm_modes(void)
+{
+  return settings.pwm_modes;
+}
+
+int settings_get_failsafe_timeout(void)
+{
+  return settings.failsafe_timeout;
+}
+
+int settings_get_failsafe_ramp(void)
+{
+  return settings.failsafe_ramp;
+}
+
+int settings_get_failsafe(int channel)
+{
+  return settings.failsafes[channel];
 }
 
 void settings_set_name(const char* in_name)
 {
-  strncpy(name, in_name, sizeof(name) - 1);
-  name[sizeof(name) - 1] = 0;
+  settings_set_string(settings.name, sizeof(settings.name), in_name);
 }
 
 void settings_set_ap_ssid(const char* in_ap_ssid)
 {
-  strncpy(ap_ssid, in_ap_ssid, sizeof(ap_ssid) - 1);
-  ap_ssid[sizeof(ap_ssid) - 1] = 0;
+  settings_set_string(settings.ap_ssid, sizeof(settings.ap_ssid), in_ap_ssid);
 }
 
 void settings_set_ap_password(const char* in_ap_password)
 {
-  strncpy(ap_password, in_ap_password, sizeof(ap_password) - 1);
-  ap_password[sizeof(ap_password) - 1] = 0;
+  settings_set_string(settings.ap_password, sizeof(settings.ap_password), in_ap_password);
 }
 
 void settings_set_ssid(const char* in_ssid)
 {
-  strncpy(ssid, in_ssid, sizeof(ssid) - 1);
-  ssid[sizeof(ssid) - 1] = 0;
+  settings_set_string(settings.ssid, sizeof(settings.ssid), in_ssid);
 }
 
 void settings_set_password(const char* in_password)
 {
-  strncpy(password, in_password, sizeof(password) - 1);
-  password[sizeof(password) - 1] = 0;
+  settings_set_string(settings.password, sizeof(settings.password), in_password);
 }
 
-// Read all settings from NVS
-esp_err_t settings_read(void)
+void settings_set_pwm_modes(const char* in_pwm_modes)
 {
-  esp_err_t err;
-  size_t length;
-  nvs_handle_t nvs_handle;
-  ESP_ERROR_CHECK( nvs_open("nvs", NVS_READWRITE, &nvs_handle) );
+  settings_set_string(settings.pwm_modes, sizeof(settings.pwm_modes), in_pwm_modes);
+}
 
-  length = sizeof(name);
-  err = nvs_get_str(nvs_handle, "bot_name", name, &length);
-  if (err != ESP_ERR_NVS_NOT_FOUND)
+bool settings_set_failsafe_timeout(int in_failsafe_timeout)
+{
+  if (in_failsafe_timeout < SETTINGS_FAILSAFE_TIMEOUT_MIN || in_failsafe_timeout > SETTINGS_FAILSAFE_TIMEOUT_MAX)
   {
-    ESP_ERROR_CHECK(err);
+    return false;
   }
-
-  length = sizeof(ap_ssid);
-  err = nvs_get_str(nvs_handle, "bot_ap_ssid", ap_ssid, &length);
-  if (err != ESP_ERR_NVS_NOT_FOUND)
+  if (settings.failsafe_timeout != in_failsafe_timeout)
   {
-    ESP_ERROR_CHECK(err);
+    settings.failsafe_timeout = in_failsafe_timeout;
+    settings_dirty = true;
   }
+  return true;
+}
 
-  length = sizeof(ap_password);
-  err = nvs_get_str(nvs_handle, "bot_ap_password", ap_password, &length);
-  if (err != ESP_ERR_NVS_NOT_FOUND)
+bool settings_set_failsafe_ramp(int in_failsafe_ramp)
+{
+  if (in_failsafe_ramp < 0 || in_failsafe_ramp > SETTINGS_FAILSAFE_RAMP_MAX)
+  {
+    return false;
+  }
+  if (settings.failsafe_ramp != in_failsafe_ramp)
   {
-    ESP_ERROR_CHECK(err);
+    settings.failsafe_ramp = in_failsafe_ramp;
+    settings_dirty = true;
   }
+  return true;
+}
 
-  length = sizeof(ssid);
-  err = nvs_get_str(nvs_handle, "bot_ssid", ssid, &length);
-  if (err != ESP_ERR_NVS_NOT_FOUND)
+// Cheap enough to call from a critical section, it never touches flash
+bool settings_set_failsafe(int channel, int in_failsafe)
+{
+  if (channel < 0 || channel >= SETTINGS_FAILSAFES || in_failsafe < INT16_MIN || in_failsafe > INT16_MAX)
   {
-    ESP_ERROR_CHECK(err);
+    return false;
   }
+  if (settings.failsafes[channel] != in_failsafe)
+  {
+    settings.failsafes[channel] = in_failsafe;
+    settings_dirty = true;
+  }
+  return true;
+}
 
-  length = sizeof(password);
-  err = nvs_get_str(nvs_handle, "bot_password", password, &length);
-  if (err != ESP_ERR_NVS_NOT_FOUND)
+// Read settings saved before they were stored as one blob, keys that are missing keep their defaults
+static void settings_read_legacy(nvs_handle_t nvs_handle)
+{
+  struct
+  {
+    const char* key;
+    char* value;
+    size_t size;
+  }
+  strings[] = {
+    { "bot_name", settings.name, sizeof(settings.name) },
+    { "bot_ap_ssid", settings.ap_ssid, sizeof(settings.ap_ssid) },
+    { "bot_ap_password", settings.ap_password, sizeof(settings.ap_password) },
+    { "bot_ssid", settings.ssid, sizeof(settings.ssid) },
+    { "bot_password", settings.password, sizeof(settings.password) },
+    { "bot_pwm_modes", settings.pwm_modes, sizeof(settings.pwm_modes) },
+  };
+  for (int index = 0; index < sizeof(strings) / sizeof(strings[0]); ++index)
   {
-    ESP_ERROR_CHECK(err);
+    size_t length = strings[index].size;
+    settings_legacy |= nvs_get_str(nvs_handle, strings[index].key, strings[index].value, &length) == ESP_OK;
   }
+  settings_legacy |= nvs_get_u16(nvs_handle, "bot_fs_timeout", &settings.failsafe_timeout) == ESP_OK;
+  settings_legacy |= nvs_get_u16(nvs_handle, "bot_fs_ramp", &settings.failsafe_ramp) == ESP_OK;
+
+  // Save them as a blob at the next commit, which erases the old keys
+  settings_dirty = settings_legacy;
+}
 
+// Read all settings from NVS
+esp_err_t settings_read(void)
+{
+  settings_store_t stored;
+  size_t length = sizeof(stored);
+  nvs_handle_t nvs_handle;
+  ESP_ERROR_CHECK( nvs_open("nvs", NVS_READWRITE, &nvs_handle) );
+  esp_err_t err = nvs_get_blob(nvs_handle, "settings", &stored, &length);
+  if (err == ESP_ERR_NVS_NOT_FOUND)
+  {
+    settings_read_legacy(nvs_handle);
+  }
   nvs_close(nvs_handle);
 
+  if (err != ESP_OK)
+  {
+    return err;
+  }
+
+  // Keep the defaults if the blob is from a different layout or damaged
+  if (length != sizeof(stored) || stored.version != SETTINGS_VERSION ||
+      stored.crc != settings_crc32(&stored, offsetof(settings_store_t, crc)))
+  {
+    ESP_LOGW(TAG, "Saved settings unusable, using defaults.");
+    return ESP_ERR_INVALID_VERSION;
+  }
+
+  settings = stored;
   return ESP_OK;
 }
 
-// Write current settings to NVS
-esp_err_t settings_write(void)
+static esp_err_t settings_write(void)
 {
+  if (!settings_dirty)
+  {
+    return ESP_OK;
+  }
+
+  // Clear the flag before taking the copy, so a setter racing the copy marks them dirty again
+  settings_dirty = false;
+  __sync_synchronize();
+
+  // Static to keep it off the scheduler task's small stack
+  static settings_store_t stored;
+  stored = settings;
+  stored.version = SETTINGS_VERSION;
+  stored.crc = settings_crc32(&stored, offsetof(settings_store_t, crc));
+
   nvs_handle_t nvs_handle;
-  ESP_ERROR_CHECK( nvs_open("nvs", NVS_READWRITE, &nvs_handle) );
-  ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "bot_name", name));
-  ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "bot_ap_ssid", ap_ssid));
-  ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "bot_ap_password", ap_password));
-  ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "bot_ssid", ssid));
-  ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "bot_password", password));
-  ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-  nvs_close(nvs_handle);
+  esp_err_t err = nvs_open("nvs", NVS_READWRITE, &nvs_handle);
+  if (err == ESP_OK)
+  {
+    err = nvs_set_blob(nvs_handle, "settings", &stored, sizeof(stored));
+    if (err == ESP_OK && settings_legacy)
+    {
+      for (int index = 0; index < sizeof(settings_legacy_keys) / sizeof(settings_legacy_keys[0]); ++index)
+      {
+        nvs_erase_key(nvs_handle, settings_legacy_keys[index]);
+      }
+    }
+    if (err == ESP_OK)
+    {
+      err = nvs_commit(nvs_handle);
+    }
+    nvs_close(nvs_handle);
+  }
 
+  if (err != ESP_OK)
+  {
+    ESP_LOGW(TAG, "Failed to save settings: %s", esp_err_to_name(err));
+    settings_dirty = true;
+    return err;
+  }
+  settings_legacy = false;
+  ESP_LOGI(TAG, "Settings saved");
   return ESP_OK;
 }
 
+// Write the settings to NVS if they have changed since they were last written
+esp_err_t settings_commit(void)
+{
+  xSemaphoreTake(settings_commit_lock, portMAX_DELAY);
+  const esp_err_t err = settings_write();
+  xSemaphoreGive(settings_commit_lock);
+  return err;
+}
+
 // Apply default settings, in memory only
 esp_err_t settings_apply_defaults(void)
 {
-  strcpy(name, CONFIG_BOT_NAME);
+  strcpy(settings.name, CONFIG_BOT_NAME);
   char* hostname = generate_hostname();
-  strcpy(ap_ssid, hostname);
+  strcpy(settings.ap_ssid, hostname);
   free(hostname);
   hostname = NULL;
-  strcpy(ap_password, generate_password());
-  strcpy(ssid, CONFIG_ESP_WIFI_SSID);
-  strcpy(password, CONFIG_ESP_WIFI_PASSWORD);
+  strcpy(settings.ap_password, generate_password());
+  strcpy(settings.ssid, CONFIG_ESP_WIFI_SSID);
+  strcpy(settings.password, CONFIG_ESP_WIFI_PASSWORD);
+  strcpy(settings.pwm_modes, "50hz");
+  settings.failsafe_timeout = 500;
+  settings.failsafe_ramp = 0;
+  for (int channel = 0; channel < SETTINGS_FAILSAFES; ++channel)
+  {
+    settings.failsafes[channel] = 1500;
+  }
   return ESP_OK;
 }
 
 // Apply default settings and erase NVS storage
 esp_err_t settings_reset_defaults(void)
 {
-  // Erase NVS
+  // Erase NVS, never while a commit is writing to it
+  xSemaphoreTake(settings_commit_lock, portMAX_DELAY);
   nvs_handle_t nvs_handle;
   ESP_ERROR_CHECK(nvs_open("nvs", NVS_READWRITE, &nvs_handle));
   ESP_ERROR_CHECK(nvs_erase_all(nvs_handle));
   ESP_ERROR_CHECK(nvs_commit(nvs_handle));
   nvs_close(nvs_handle);
 
-  // Apply default settings
+  // Apply default settings, which is what an empty NVS reads back as anyway
   settings_apply_defaults();
+  settings_dirty = false;
+  settings_legacy = false;
+  xSemaphoreGive(settings_commit_lock);
 
   return ESP_OK;
 }
 
 void settings_init(void)
 {
+  settings_commit_lock = xSemaphoreCreateMutex();
   settings_apply_defaults();
   settings_read();
 }
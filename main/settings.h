@@ -1,21 +1,42 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include "esp_err.h"
 
+// Failsafe timing limits in ms, the timeout is how long outputs hold before ramping to the failsafes
+#define SETTINGS_FAILSAFE_TIMEOUT_MIN 100
+#define SETTINGS_FAILSAFE_TIMEOUT_MAX 10000
+#define SETTINGS_FAILSAFE_RAMP_MAX    10000
+
+// Failsafe pulse widths are saved for this many channels
+#define SETTINGS_FAILSAFES 6
+
 const char* settings_get_name(void);
 const char* settings_get_ap_ssid(void);
 const char* settings_get_ap_password(void);
 const char* settings_get_ssid(void);
 const char* settings_get_password(void);
+const char* settings_get_pwm_modes(void);
+int settings_get_failsafe_timeout(void);
+int settings_get_failsafe_ramp(void);
+int settings_get_failsafe(int channel);
 
 void settings_set_name(const char* in_name);
 void settings_set_ap_ssid(const char* in_ap_ssid);
 void settings_set_ap_password(const char* in_ap_password);
 void settings_set_ssid(const char* in_ssid);
 void settings_set_password(const char* in_password);
+void settings_set_pwm_modes(const char* in_pwm_modes);
+bool settings_set_failsafe_timeout(int in_failsafe_timeout);
+bool settings_set_failsafe_ramp(int in_failsafe_ramp);
+bool settings_set_failsafe(int channel, int in_failsafe);
 
 esp_err_t settings_read(void);
-esp_err_t settings_write(void);
+
+// Save the settings if any have changed, setters never write to flash themselves
+esp_err_t settings_commit(void);
+
 esp_err_t settings_apply_defaults(void);
 esp_err_t settings_reset_defaults(void);
 
@@ -0,0 +1,243 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "driver/soc.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+#include "slew.h"
+
+static const char* TAG = "m-link-slew";
+
+#ifndef CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ
+#define CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ 80
+#endif
+
+// Positions are in 1/256 us
+#define SLEW_SHIFT  8
+
+// Frame gaps longer than this mean the stream paused, so they don't count towards the interval estimate
+#define SLEW_MAX_INTERVAL_US  250000
+#define SLEW_DEFAULT_INTERVAL_US  20000
+
+typedef struct
+{
+  int32_t position;   // Current output
+  int32_t start;      // Where the glide to the target began
+  int32_t target;
+}
+slew_channel_t;
+
+static slew_config_t slew_config;
+static volatile bool slew_dirty = false;
+static SemaphoreHandle_t slew_commit_lock = NULL;
+static slew_channel_t slew_channels[SLEW_CHANNELS];
+
+// Estimated time between frames, and the glide in progress
+static uint32_t frame_interval_us = SLEW_DEFAULT_INTERVAL_US;
+static uint32_t glide_us = 0;
+static uint32_t last_frame = 0;
+static uint32_t last_step = 0;
+static bool have_frame = false;
+
+static inline uint32_t slew_elapsed_us(uint32_t since, uint32_t now)
+{
+  return (now - since) / CONFIG_ESP8266_DEFAULT_CPU_FREQ_MHZ;
+}
+
+void slew_set_targets(const int* targets)
+{
+  const uint32_t now = soc_get_ccount();
+
+  // Track the frame interval with a moving average, a quarter of each new sample at a time
+  const uint32_t interval = slew_elapsed_us(last_frame, now);
+  const bool streaming = have_frame && interval < SLEW_MAX_INTERVAL_US;
+  if (streaming)
+  {
+    frame_interval_us += ((int32_t)interval - (int32_t)frame_interval_us) / 4;
+  }
+  last_frame = now;
+  have_frame = true;
+
+  // Glide over the time until the next frame should arrive, after a pause there is nothing to go on so jump
+  glide_us = streaming ? frame_interval_us : 0;
+  if (!streaming)
+  {
+    last_step = now;
+  }
+
+  for (int channel = 0; channel < SLEW_CHANNELS; ++channel)
+  {
+    slew_channel_t* state = &slew_channels[channel];
+    const int32_t target = targets[channel] << SLEW_SHIFT;
+
+    // Unchanged channels, from partial updates, finish any glide they have from where they are now
+    if (target == state->target)
+    {
+      state->start = (state->start == target) ? target : state->position;
+      continue;
+    }
+
+    const int32_t distance = target - state->position;
+    const bool glide = (slew_config.interpolate_mask & (1u << channel)) &&
+                       distance < (SLEW_INTERPOLATE_MAX_US << SLEW_SHIFT) &&
+                       distance > -(SLEW_INTERPOLATE_MAX_US << SLEW_SHIFT);
+    state->start = glide ? state->position : target;
+    state->target = target;
+  }
+}
+
+void slew_reset(int channel, int pulsewidth)
+{
+  if (channel >= 0 && channel < SLEW_CHANNELS)
+  {
+    slew_channel_t* state = &slew_channels[channel];
+    state->position = state->start = state->target = pulsewidth << SLEW_SHIFT;
+  }
+}
+
+bool slew_step(int* outputs)
+{
+  const uint32_t now = soc_get_ccount();
+
+  // Fraction of the glide done so far, in 1/1024ths
+  const uint32_t since_frame = slew_elapsed_us(last_frame, now);
+  const int32_t progress = (glide_us == 0 || since_frame >= glide_us) ? 1024 : (int32_t)((since_frame << 10) / glide_us);
+
+  // Time since the last step, for the slew limit, capped so a long sleep can't overflow the step size
+  uint32_t step_us = slew_elapsed_us(last_step, now);
+  step_us = step_us > SLEW_MAX_INTERVAL_US / 5 ? SLEW_MAX_INTERVAL_US / 5 : step_us;
+  last_step = now;
+
+  bool moving = false;
+  for (int channel = 0; channel < SLEW_CHANNELS; ++channel)
+  {
+    slew_channel_t* state = &slew_channels[channel];
+
+    // Where the glide says the channel should be by now
+    int32_t goal = state->start + (((state->target - state->start) * progress) >> 10);
+
+    // Limit the change since the last step, rate * step_us / 1000000 us in 1/256 us
+    const uint32_t rate = slew_config.rate[channel];
+    if (rate)
+    {
+      const int32_t max_change = (int32_t)(rate * step_us / (1000000 >> SLEW_SHIFT));
+      const int32_t change = goal - state->position;
+      if (change > max_change)
+      {
+        goal = state->position + max_change;
+      }
+      else if (change < -max_change)
+      {
+        goal = state->position - max_change;
+      }
+    }
+
+    state->position = goal;
+    moving |= (goal != state->target);
+    outputs[channel] = (goal + (1 << (SLEW_SHIFT - 1))) >> SLEW_SHIFT;
+  }
+
+  return moving;
+}
+
+void slew_get_config(slew_config_t* config)
+{
+  *config = slew_config;
+}
+
+static bool slew_config_valid(const slew_config_t* config)
+{
+  for (int channel = 0; channel < SLEW_CHANNELS; ++channel)
+  {
+    if (config->rate[channel] < 0)
+    {
+      return false;
+    }
+  }
+  return (config->interpolate_mask >> SLEW_CHANNELS) == 0;
+}
+
+bool slew_set_config(const slew_config_t* config)
+{
+  if (!slew_config_valid(config))
+  {
+    return false;
+  }
+
+  // rx_task reads the configuration on every step, so swap it while no task can be part way through one
+  vTaskSuspendAll();
+  slew_config = *config;
+  slew_dirty = true;
+  xTaskResumeAll();
+
+  return true;
+}
+
+esp_err_t slew_commit(void)
+{
+  // Held for the whole commit, so a commit before a reboot waits for one in progress rather than finding it clean
+  xSemaphoreTake(slew_commit_lock, portMAX_DELAY);
+  esp_err_t err = ESP_OK;
+  if (slew_dirty)
+  {
+    // Clear the flag before taking the copy, so a change racing the copy marks it dirty again
+    slew_config_t config;
+    vTaskSuspendAll();
+    slew_dirty = false;
+    config = slew_config;
+    xTaskResumeAll();
+
+    nvs_handle_t nvs_handle;
+    err = nvs_open("nvs", NVS_READWRITE, &nvs_handle);
+    if (err == ESP_OK)
+    {
+      err = nvs_set_blob(nvs_handle, "slew", &config, sizeof(config));
+      if (err == ESP_OK)
+      {
+        err = nvs_commit(nvs_handle);
+      }
+      nvs_close(nvs_handle);
+    }
+
+    if (err != ESP_OK)
+    {
+      ESP_LOGW(TAG, "Failed to save slew configuration: %s", esp_err_to_name(err));
+      slew_dirty = true;
+    }
+  }
+  xSemaphoreGive(slew_commit_lock);
+  return err;
+}
+
+void slew_init(void)
+{
+  slew_commit_lock = xSemaphoreCreateMutex();
+
+  for (int channel = 0; channel < SLEW_CHANNELS; ++channel)
+  {
+    slew_reset(channel, 1500);
+  }
+
+  slew_config_t config;
+  size_t length = sizeof(config);
+  nvs_handle_t nvs_handle;
+  ESP_ERROR_CHECK( nvs_open("nvs", NVS_READWRITE, &nvs_handle) );
+  esp_err_t err = nvs_get_blob(nvs_handle, "slew", &config, &length);
+  nvs_close(nvs_handle);
+
+  // Without a usable saved configuration pass frames straight through
+  if (err != ESP_OK || length != sizeof(config) || !slew_config_valid(&config))
+  {
+    if (err != ESP_ERR_NVS_NOT_FOUND)
+    {
+      ESP_LOGW(TAG, "Saved slew configuration unusable, using defaults.");
+    }
+    memset(&config, 0, sizeof(config));
+  }
+  slew_config = config;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * Output smoothing, run by rx_task between the latest frame and the servo driver
+ *
+ * Each channel can have a slew rate limit, and can glide linearly from where it is to each new target over the
+ * estimated time until the next frame arrives, rather than holding and then jumping. Positions are kept in 1/256 us
+ * fixed point so slow rates still move every step.
+ */
+#define SLEW_CHANNELS  6
+
+// Interval between smoothing steps while any channel is still moving
+#define SLEW_STEP_MS   10
+
+// Moves bigger than this are deliberate, and skip interpolation so they start at full speed
+#define SLEW_INTERPOLATE_MAX_US  250
+
+typedef struct
+{
+  int16_t rate[SLEW_CHANNELS];    // Fastest change in us per second, 0 is unlimited
+  uint16_t interpolate_mask;      // Bit set for each channel that glides between frames
+}
+slew_config_t;
+
+// Load the configuration from NVS, or no smoothing at all if there is none
+void slew_init(void);
+
+void slew_get_config(slew_config_t* config);
+
+// Validate and apply a new configuration, returns false without changing anything if it is invalid
+bool slew_set_config(const slew_config_t* config);
+
+// Save the configuration to NVS if it has changed, it stays marked as changed if saving fails
+esp_err_t slew_commit(void);
+
+// Start moving towards a new frame of targets, indexed by channel
+void slew_set_targets(const int* targets);
+
+// Jump a channel straight to a pulse width, for when something else has been driving it
+void slew_reset(int channel, int pulsewidth);
+
+// Advance every channel towards its target, returns true while any channel has further to go
+bool slew_step(int* outputs);
@@ -0,0 +1,214 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+#include "lwip/sockets.h"
+
+#include "latency.h"
+#include "protocol.h"
+#include "udp.h"
+
+#ifdef CONFIG_MLINK_UDP_CONTROL
+
+static const char* TAG = "m-link-udp";
+
+/* One client per WebSocket session */
+#define UDP_MAX_CLIENTS 4
+
+#define UDP_DATAGRAM_MAX (UDP_TOKEN_LEN + MLINK_BINARY_MAX_LEN)
+
+typedef struct
+{
+  uint32_t token;
+  uint32_t addr;
+  sequence_state_t sequence;
+}
+udp_client_t;
+
+/* Written by the httpd task, read by the UDP task, both under a critical section */
+static udp_client_t udp_clients[UDP_MAX_CLIENTS];
+
+static udp_stats_t udp_stats;
+static TickType_t udp_last_frame;
+
+static uint32_t get_le32(const uint8_t* p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Decode a datagram and check it comes from a registered client, returns false if it should be ignored
+static bool udp_accept(const uint8_t* datagram, int len, const struct sockaddr_in* from, servo_frame_t* frame)
+{
+  if (len <= UDP_TOKEN_LEN || !protocol_decode_binary(datagram + UDP_TOKEN_LEN, len - UDP_TOKEN_LEN, frame) || !frame->has_seq)
+  {
+    ++udp_stats.rejected;
+    return false;
+  }
+
+  const uint32_t token = get_le32(datagram);
+  bool known = false;
+  bool accepted = false;
+  portENTER_CRITICAL();
+  for (int i = 0; i < UDP_MAX_CLIENTS; ++i)
+  {
+    udp_client_t* client = &udp_clients[i];
+    if (token && client->token == token && client->addr == from->sin_addr.s_addr)
+    {
+      known = true;
+      accepted = protocol_sequence_accept(&client->sequence, frame);
+      break;
+    }
+  }
+  portEXIT_CRITICAL();
+
+  if (!known)
+  {
+    ++udp_stats.rejected;
+    return false;
+  }
+  if (!accepted)
+  {
+    ++udp_stats.stale;
+    return false;
+  }
+
+  // Track the longest wait between frames, which is where head-of-line blocking would show
+  const TickType_t now = xTaskGetTickCount();
+  if (udp_stats.frames++)
+  {
+    const uint32_t gap_ms = (now - udp_last_frame) * portTICK_PERIOD_MS;
+    if (gap_ms > udp_stats.max_gap_ms)
+    {
+      udp_stats.max_gap_ms = gap_ms;
+    }
+  }
+  udp_last_frame = now;
+  return true;
+}
+
+static void udp_task(void* pvParameters)
+{
+  ESP_LOGI(TAG, "Started UDP task.");
+
+  struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  server_addr.sin_port = htons(CONFIG_MLINK_UDP_PORT);
+
+  int sock;
+  do
+  {
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+      ESP_LOGE(TAG, "Failed to create socket.");
+      vTaskDelay(pdMS_TO_TICKS(1000));
+    }
+  }
+  while (sock < 0);
+
+  while (bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) != 0)
+  {
+    ESP_LOGE(TAG, "Failed to bind socket to port %d.", CONFIG_MLINK_UDP_PORT);
+    vTaskDelay(pdMS_TO_TICKS(1000));
+  }
+
+  uint8_t datagram[UDP_DATAGRAM_MAX + 1];
+  for (;;)
+  {
+    // Block for a datagram, then drain anything queued behind it so only the newest frame is applied
+    servo_frame_t latest;
+    bool have_frame = false;
+    int flags = 0;
+    for (;;)
+    {
+      struct sockaddr_in from;
+      socklen_t fromlen = sizeof(from);
+      const int len = recvfrom(sock, datagram, sizeof(datagram), flags, (struct sockaddr*)&from, &fromlen);
+      if (len < 0)
+      {
+        if (!flags)
+        {
+          ESP_LOGE(TAG, "recvfrom failed.");
+          vTaskDelay(pdMS_TO_TICKS(100));
+        }
+        break;
+      }
+      flags = MSG_DONTWAIT;
+
+      servo_frame_t frame;
+      const uint32_t received = latency_now();
+      if (udp_accept(datagram, len, &from, &frame))
+      {
+        frame.received = received;
+        frame.decoded = latency_now();
+        latest = frame;
+        have_frame = true;
+      }
+    }
+
+    if (have_frame)
+    {
+      protocol_apply(&latest);
+    }
+  }
+}
+
+void udp_init(void)
+{
+  xTaskCreate(udp_task, "udp-task", 2048, NULL, 8, NULL);
+}
+
+bool udp_register(uint32_t token, uint32_t addr)
+{
+  bool registered = false;
+  portENTER_CRITICAL();
+  for (int i = 0; i < UDP_MAX_CLIENTS; ++i)
+  {
+    if (!udp_clients[i].token)
+    {
+      udp_clients[i].token = token;
+      udp_clients[i].addr = addr;
+      memset(&udp_clients[i].sequence, 0, sizeof(udp_clients[i].sequence));
+      registered = true;
+      break;
+    }
+  }
+  portEXIT_CRITICAL();
+  return registered;
+}
+
+void udp_unregister(uint32_t token)
+{
+  portENTER_CRITICAL();
+  for (int i = 0; i < UDP_MAX_CLIENTS; ++i)
+  {
+    if (token && udp_clients[i].token == token)
+    {
+      udp_clients[i].token = 0;
+    }
+  }
+  portEXIT_CRITICAL();
+}
+
+uint16_t udp_get_port(void)
+{
+  return CONFIG_MLINK_UDP_PORT;
+}
+
+void udp_get_stats(udp_stats_t* stats, bool reset)
+{
+  portENTER_CRITICAL();
+  *stats = udp_stats;
+  if (reset)
+  {
+    memset(&udp_stats, 0, sizeof(udp_stats));
+  }
+  portEXIT_CRITICAL();
+}
+
+#endif
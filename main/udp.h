@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * UDP control channel, servo datagrams that bypass the WebSocket's TCP stream
+ *
+ * Byte 0..3  Little-endian uint32 token, handed out over an authenticated WebSocket session
+ * Byte 4..   Version 2 binary servo frame (see protocol.h), which must carry a sequence number
+ *
+ * Datagrams are only accepted from the address the token was issued to, and the newest frame wins.
+ */
+#define UDP_TOKEN_LEN 4
+
+typedef struct
+{
+  uint32_t frames;
+  uint32_t stale;
+  uint32_t rejected;
+  uint32_t max_gap_ms;
+}
+udp_stats_t;
+
+void udp_init(void);
+
+// Accept servo datagrams carrying token from the given IPv4 address (network byte order), returns false if every slot is taken
+bool udp_register(uint32_t token, uint32_t addr);
+
+void udp_unregister(uint32_t token);
+
+uint16_t udp_get_port(void);
+
+// Read and optionally clear the datagram counters
+void udp_get_stats(udp_stats_t* stats, bool reset);
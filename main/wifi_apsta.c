@@ -1,7 +1,6 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/event_groups.h"
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_netif.h"
@@ -23,46 +22,63 @@
 #define MLINK_WIFI_AP_PASSWORD     CONFIG_ESP_WIFI_AP_PASSWORD
 #define MLINK_MAX_STA_CONN         CONFIG_ESP_MAX_STA_CONN
 
-/* FreeRTOS event group to signal when we are connected*/
-static EventGroupHandle_t s_wifi_event_group;
-
-/* The event group allows multiple bits for each event, but we only care about two events:
- * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
-
 static const char *TAG = "wifi-apsta";
 
 static int s_retry_num = 0;
+static int s_ap_stations = 0;
+static bool s_retry_held = false;
+
+static void sta_retry(void)
+{
+    if (s_retry_num < MLINK_ESP_MAXIMUM_RETRY) {
+        esp_wifi_connect();
+        s_retry_num++;
+        ESP_LOGI(TAG, "retry to connect to the AP");
+    } else {
+        ESP_LOGI(TAG, "Failed to connect to SSID:%s, giving up", settings_get_ssid());
+    }
+}
 
+/* The STA connects in the background from these events, so the AP, web server and control loop never wait for it.
+ * Once the maximum number of retries is used up the STA stays disconnected and the AP carries on alone.
+ *
+ * Each attempt scans every channel, which takes the radio off the AP's channel and stalls anyone driving through it.
+ * So while any station is connected to the AP the retries are held, and only resume once the last one leaves. The
+ * trade-off is that the device won't join the external network while someone is connected to its own AP, unless the
+ * attempt already in flight when they connected succeeds. */
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < MLINK_ESP_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
+        ESP_LOGI(TAG,"connect to the AP fail");
+        if (s_ap_stations > 0) {
+            s_retry_held = true;
+            ESP_LOGI(TAG, "Holding STA retries while %d station(s) use the AP", s_ap_stations);
         } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+            sta_retry();
+        }
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STACONNECTED) {
+        s_ap_stations++;
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STADISCONNECTED) {
+        if (s_ap_stations > 0) {
+            s_ap_stations--;
+        }
+        if (s_ap_stations == 0 && s_retry_held) {
+            s_retry_held = false;
+            sta_retry();
         }
-        ESP_LOGI(TAG,"connect to the AP fail");
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "got ip: %s",
-                 ip4addr_ntoa(&event->ip_info.ip));
+        ESP_LOGI(TAG, "connected to ap SSID:%s, got ip: %s",
+                 settings_get_ssid(), ip4addr_ntoa(&event->ip_info.ip));
         s_retry_num = 0;
-        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
 
 void wifi_init_apsta_impl(void)
 {
-    s_wifi_event_group = xEventGroupCreate();
-
     tcpip_adapter_init();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
@@ -133,46 +149,6 @@ void wifi_init_apsta_impl(void)
         (ip >> 16) & 0xff,
         (ip >> 24) & 0xff
     );
-
-    // STA not configured, we are done
-    if (!use_sta)
-    {
-      return;
-    }
-
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-
-    /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-     * happened. */
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
-                 wifi_config_ap.ap.ssid, wifi_config_ap.ap.password);
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
-                 wifi_config_ap.ap.ssid, wifi_config_ap.ap.password);
-    } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
-    }
-
-    ESP_ERROR_CHECK( tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &ap_ip) );
-    
-    ip = (uint32_t)(ap_ip.ip.addr);
-    ESP_LOGI(TAG, "tcpip_adapter STA ip: %d.%d.%d.%d",
-        (ip) & 0xff,
-        (ip >> 8) & 0xff,
-        (ip >> 16) & 0xff,
-        (ip >> 24) & 0xff
-    );
-
-    ESP_ERROR_CHECK(esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler));
-    ESP_ERROR_CHECK(esp_event_handler_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler));
-    vEventGroupDelete(s_wifi_event_group);
 }
 
 void wifi_init_apsta(void)
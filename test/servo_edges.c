@@ -0,0 +1,247 @@
+/*
+ * Host-side tests for the PWM edge tables and the schedule the timer interrupt plays them on
+ *
+ * The schedule runs against a virtual clock here, each edge is played at exactly its due time, so any pulse that comes
+ * out the wrong width or period is down to the tables or the schedule rather than interrupt timing.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "servo_edges.h"
+
+#define CHANNELS  6
+#define MAX_PULSES 64
+
+static int failures = 0;
+
+#define CHECK(condition, ...) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      printf("%s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      ++failures; \
+    } \
+  } \
+  while (0)
+
+static const uint32_t masks[CHANNELS] = { 1u << 4, 1u << 5, 1u << 12, 1u << 15, 1u << 14, 1u << 13 };
+
+// Every pulse seen on each channel
+typedef struct
+{
+  bool high;
+  int count;
+  uint32_t rise[MAX_PULSES];
+  uint32_t width[MAX_PULSES];
+}
+trace_t;
+
+static trace_t traces[CHANNELS];
+
+// Play every edge due up to the given time, like the interrupt would
+static uint32_t run(servo_group_t* groups, int count, uint32_t now, uint32_t until)
+{
+  uint32_t at;
+  while (servo_groups_next(groups, count, now, &at) && (int32_t)(at - until) <= 0)
+  {
+    uint32_t set_mask = 0;
+    uint32_t clear_mask = 0;
+    servo_groups_play(groups, count, at, &set_mask, &clear_mask);
+    CHECK((set_mask & clear_mask) == 0, "pins 0x%x raised and lowered together at %u", set_mask & clear_mask, at);
+    for (int channel = 0; channel < CHANNELS; ++channel)
+    {
+      trace_t* trace = &traces[channel];
+      if (clear_mask & masks[channel])
+      {
+        CHECK(trace->high, "channel %d lowered while low at %u", channel, at);
+        trace->high = false;
+        trace->width[trace->count - 1] = at - trace->rise[trace->count - 1];
+      }
+      if (set_mask & masks[channel])
+      {
+        CHECK(!trace->high, "channel %d raised while high at %u", channel, at);
+        trace->high = true;
+        if (trace->count < MAX_PULSES)
+        {
+          trace->rise[trace->count++] = at;
+        }
+      }
+    }
+    now = at;
+  }
+  return until;
+}
+
+static void reset_traces(void)
+{
+  memset(traces, 0, sizeof(traces));
+}
+
+static void test_build(void)
+{
+  const uint32_t duties[CHANNELS] = { 3000, 1000, 2000, 1000, 5000, 1001 };
+  servo_edges_t edges;
+  servo_edges_build(&edges, masks, duties, CHANNELS, 0x3f);
+
+  CHECK(edges.set_mask == (masks[0] | masks[1] | masks[2] | masks[3] | masks[4] | masks[5]), "set mask 0x%x", edges.set_mask);
+  CHECK(edges.count == 5, "%d edges", edges.count);
+  const uint32_t times[] = { 1000, 1001, 2000, 3000, 5000 };
+  const uint32_t clears[] = { masks[1] | masks[3], masks[5], masks[2], masks[0], masks[4] };
+  for (int index = 0; index < 5 && index < edges.count; ++index)
+  {
+    CHECK(edges.time[index] == times[index], "edge %d at %u, expected %u", index, edges.time[index], times[index]);
+    CHECK(edges.clear_mask[index] == clears[index], "edge %d clears 0x%x, expected 0x%x", index, edges.clear_mask[index], clears[index]);
+  }
+
+  // Only the selected channels are included
+  servo_edges_build(&edges, masks, duties, CHANNELS, (1u << 0) | (1u << 4));
+  CHECK(edges.set_mask == (masks[0] | masks[4]), "selected set mask 0x%x", edges.set_mask);
+  CHECK(edges.count == 2 && edges.time[0] == 3000 && edges.time[1] == 5000, "selected edges wrong");
+
+  servo_edges_build(&edges, masks, duties, CHANNELS, 0);
+  CHECK(edges.set_mask == 0 && edges.count == 0, "empty table not empty");
+}
+
+static void test_single_group(void)
+{
+  reset_traces();
+  const uint32_t duties[CHANNELS] = { 1500, 1000, 2000, 1500, 1200, 1800 };
+  servo_group_t group;
+  servo_group_init(&group, 20000, 100);
+  servo_edges_build(&group.edges[group.active ^ 1], masks, duties, CHANNELS, 0x3f);
+  group.pending = true;
+
+  run(&group, 1, 0, 100 + 5 * 20000 - 1);
+  for (int channel = 0; channel < CHANNELS; ++channel)
+  {
+    const trace_t* trace = &traces[channel];
+    CHECK(trace->count == 5, "channel %d has %d pulses", channel, trace->count);
+    for (int pulse = 0; pulse < trace->count; ++pulse)
+    {
+      CHECK(trace->rise[pulse] == 100 + (uint32_t)pulse * 20000, "channel %d pulse %d rose at %u", channel, pulse, trace->rise[pulse]);
+      CHECK(trace->width[pulse] == duties[channel], "channel %d pulse %d is %u wide", channel, pulse, trace->width[pulse]);
+    }
+  }
+}
+
+static void test_swap_at_boundary(void)
+{
+  reset_traces();
+  uint32_t duties[CHANNELS] = { 1500, 1500, 1500, 1500, 1500, 1500 };
+  servo_group_t group;
+  servo_group_init(&group, 20000, 0);
+  servo_edges_build(&group.edges[group.active ^ 1], masks, duties, CHANNELS, 0x3f);
+  group.pending = true;
+
+  // Change the duties while the first pulses are in flight
+  uint32_t now = run(&group, 1, 0, 1000);
+  duties[0] = 1000;
+  duties[1] = 2000;
+  group.pending = false;
+  servo_edges_build(&group.edges[group.active ^ 1], masks, duties, CHANNELS, 0x3f);
+  group.pending = true;
+  run(&group, 1, now, 2 * 20000 - 1);
+
+  CHECK(traces[0].count == 2 && traces[1].count == 2, "%d and %d pulses", traces[0].count, traces[1].count);
+  CHECK(traces[0].width[0] == 1500 && traces[1].width[0] == 1500, "pulses in flight changed to %u and %u", traces[0].width[0], traces[1].width[0]);
+  CHECK(traces[0].width[1] == 1000 && traces[1].width[1] == 2000, "next pulses are %u and %u", traces[0].width[1], traces[1].width[1]);
+  CHECK(!group.pending, "table not picked up");
+}
+
+static void test_groups(void)
+{
+  reset_traces();
+  const uint32_t duties[CHANNELS] = { 1500, 1500, 1000, 1000, 125, 42 };
+  servo_group_t groups[3];
+  servo_group_init(&groups[0], 20000, 0);
+  servo_group_init(&groups[1], 3000, 0);
+  servo_group_init(&groups[2], 500, 0);
+  servo_edges_build(&groups[0].edges[1], masks, duties, CHANNELS, 0x03);
+  servo_edges_build(&groups[1].edges[1], masks, duties, CHANNELS, 0x0c);
+  servo_edges_build(&groups[2].edges[1], masks, duties, CHANNELS, 0x30);
+  for (int index = 0; index < 3; ++index)
+  {
+    groups[index].pending = true;
+  }
+
+  run(groups, 3, 0, 2 * 20000 - 1);
+  const uint32_t periods[CHANNELS] = { 20000, 20000, 3000, 3000, 500, 500 };
+  for (int channel = 0; channel < CHANNELS; ++channel)
+  {
+    const trace_t* trace = &traces[channel];
+    const int expected = (2 * 20000 + periods[channel] - 1) / periods[channel];
+    CHECK(trace->count == (expected < MAX_PULSES ? expected : MAX_PULSES), "channel %d has %d pulses", channel, trace->count);
+    for (int pulse = 0; pulse < trace->count; ++pulse)
+    {
+      CHECK(trace->rise[pulse] == (uint32_t)pulse * periods[channel], "channel %d pulse %d rose at %u", channel, pulse, trace->rise[pulse]);
+      if (pulse + 1 < trace->count)
+      {
+        CHECK(trace->width[pulse] == duties[channel], "channel %d pulse %d is %u wide", channel, pulse, trace->width[pulse]);
+      }
+    }
+  }
+}
+
+static void test_idle_group(void)
+{
+  reset_traces();
+  const uint32_t duties[CHANNELS] = { 1500, 100, 1500, 1500, 1500, 1500 };
+  servo_group_t groups[2];
+  servo_group_init(&groups[0], 20000, 0);
+  servo_group_init(&groups[1], 500, 0);
+  servo_edges_build(&groups[0].edges[1], masks, duties, CHANNELS, 0x01);
+  groups[0].pending = true;
+
+  // The idle group takes no edges at all
+  uint32_t now = run(groups, 2, 0, 100000 - 1);
+  CHECK(traces[1].count == 0, "idle group played %d pulses", traces[1].count);
+
+  // Once it has a table it starts straight away instead of catching up on the periods it skipped
+  servo_edges_build(&groups[1].edges[groups[1].active ^ 1], masks, duties, CHANNELS, 0x02);
+  groups[1].pending = true;
+  now = run(groups, 2, now, now);
+  CHECK(traces[1].count == 1 && traces[1].rise[0] == now, "woke with %d pulses", traces[1].count);
+  run(groups, 2, now, now + 2000);
+  CHECK(traces[1].count == 5 && traces[1].rise[4] == now + 2000, "woke group has %d pulses", traces[1].count);
+  CHECK(traces[0].count == 6, "busy group has %d pulses", traces[0].count);
+}
+
+static void test_wrap(void)
+{
+  reset_traces();
+  const uint32_t duties[CHANNELS] = { 1500, 1500, 1500, 1500, 1500, 1500 };
+  const uint32_t first = UINT32_MAX - 30000;
+  servo_group_t group;
+  servo_group_init(&group, 20000, first);
+  servo_edges_build(&group.edges[group.active ^ 1], masks, duties, CHANNELS, 0x01);
+  group.pending = true;
+
+  run(&group, 1, first - 1, first + 3 * 20000 - 1);
+  CHECK(traces[0].count == 3, "%d pulses across the counter wrapping", traces[0].count);
+  for (int pulse = 0; pulse < traces[0].count; ++pulse)
+  {
+    CHECK(traces[0].rise[pulse] == first + pulse * 20000u, "pulse %d rose at %u", pulse, traces[0].rise[pulse]);
+    CHECK(traces[0].width[pulse] == 1500, "pulse %d is %u wide", pulse, traces[0].width[pulse]);
+  }
+}
+
+int main(void)
+{
+  test_build();
+  test_single_group();
+  test_swap_at_boundary();
+  test_groups();
+  test_idle_group();
+  test_wrap();
+
+  if (failures)
+  {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}